@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "advisor.h"
+#include "policy.h"
+#include "device.h"
+#include "rand.h"
+
+typedef struct advisor {
+    const game_t *game;
+    uint16_t building;
+    const policy_t *policy;
+    advice_t *candidates;
+    int count;
+    uint64_t seeds[ADVISOR_ROLLOUTS];
+    uint64_t deadline;
+    long next;
+    pthread_mutex_t lock;
+} advisor_t;
+
+/* Play one rollout into SCRATCH. Returns false if the deadline hit
+ * before the horizon, in which case the rollout is discarded. */
+static bool
+advisor_rollout(advisor_t *a, game_t *scratch, advice_t *c, int round)
+{
+    game_copy(scratch, a->game);
+    scratch->rand_state = a->seeds[round];
+    game_build(scratch, a->building, c->x, c->y);
+    long end = scratch->time + ADVISOR_HORIZON;
+    bool lost = false;
+    while (!lost && scratch->time < end) {
+        if ((scratch->time & 0xfff) == 0 && device_uepoch() >= a->deadline)
+            return false;
+        if (scratch->time % (long)POLICY_PERIOD == 0)
+            a->policy->step(scratch);
+        game_step(scratch);
+        enum game_event event;
+        while ((event = game_event_pop(scratch)) != EVENT_NONE)
+            if (event == EVENT_LOSE)
+                lost = true;
+    }
+    bool stood = map_building(&scratch->map, c->x, c->y) == a->building;
+    pthread_mutex_lock(&a->lock);
+    c->survival += !lost && stood;
+    c->value += scratch->gold + scratch->food + scratch->wood;
+    c->population += scratch->population;
+    c->rollouts++;
+    pthread_mutex_unlock(&a->lock);
+    return true;
+}
+
+static void *
+advisor_worker(void *arg)
+{
+    advisor_t *a = arg;
+    game_t *scratch = game_clone(a->game);
+    if (!scratch)
+        return NULL;
+    long total = (long)a->count * ADVISOR_ROLLOUTS;
+    for (;;) {
+        /* Jobs are handed out round by round so every candidate gets
+         * its Nth rollout before any gets its N+1th. */
+        long job = __sync_fetch_and_add(&a->next, 1);
+        if (job >= total || device_uepoch() >= a->deadline)
+            break;
+        advice_t *c = a->candidates + job % a->count;
+        if (!advisor_rollout(a, scratch, c, job / a->count))
+            break;
+    }
+    game_free(scratch);
+    return NULL;
+}
+
+static int
+advice_compare(const void *a, const void *b)
+{
+    const advice_t *x = a;
+    const advice_t *y = b;
+    if (!x->rollouts || !y->rollouts)
+        return !x->rollouts - !y->rollouts;
+    if (x->survival != y->survival)
+        return x->survival < y->survival ? 1 : -1;
+    float vx = x->value + x->population;
+    float vy = y->value + y->population;
+    return (vx < vy) - (vx > vy);
+}
+
+int
+advisor_rank(const game_t *game, uint16_t building,
+             advice_t *out, int max, uint64_t budget, int threads)
+{
+    advisor_t a = {
+        .game = game,
+        .building = building,
+        .policy = policy_find("defend"),
+        .deadline = device_uepoch() + budget,
+    };
+    a.candidates = malloc(sizeof(*a.candidates) * MAP_WIDTH * MAP_HEIGHT);
+    game_t *probe = game_clone(game);
+    if (a.candidates && probe)
+        for (int y = 0; y < MAP_HEIGHT; y++)
+            for (int x = 0; x < MAP_WIDTH; x++)
+                if (game_can_build(probe, building, x, y))
+                    a.candidates[a.count++] = (advice_t){x, y, 0, 0, 0, 0};
+    game_free(probe);
+    if (a.count == 0) {
+        free(a.candidates);
+        return 0;
+    }
+
+    /* Every candidate sees the same invasions in a given round. */
+    uint64_t state = game->rand_state;
+    for (int i = 0; i < ADVISOR_ROLLOUTS; i++)
+        a.seeds[i] = xorshift(&state) | 1;
+
+    pthread_mutex_init(&a.lock, NULL);
+    if (threads < 1)
+        threads = device_cpu_count();
+    pthread_t workers[threads];
+    int started = 0;
+    for (int i = 0; i < threads; i++)
+        if (pthread_create(workers + started, NULL, advisor_worker, &a) == 0)
+            started++;
+    if (started == 0)
+        advisor_worker(&a);
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    pthread_mutex_destroy(&a.lock);
+
+    for (int i = 0; i < a.count; i++) {
+        advice_t *c = a.candidates + i;
+        if (c->rollouts) {
+            c->survival /= c->rollouts;
+            c->value /= c->rollouts;
+            c->population /= c->rollouts;
+        }
+    }
+    qsort(a.candidates, a.count, sizeof(*a.candidates), advice_compare);
+    int n = 0;
+    for (; n < max && n < a.count && a.candidates[n].rollouts; n++)
+        out[n] = a.candidates[n];
+    free(a.candidates);
+    return n;
+}
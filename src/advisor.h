@@ -0,0 +1,23 @@
+/**
+ * Build placement advisor. Every valid position for a building is
+ * scored by short headless rollouts of the game, run in parallel and
+ * cut off at a fixed wall-clock budget.
+ */
+#pragma once
+
+#include "game.h"
+
+#define ADVISOR_HORIZON  (2 * DAY)
+#define ADVISOR_ROLLOUTS 16
+#define ADVISOR_BUDGET   400000 // microseconds
+
+typedef struct advice {
+    int x, y;
+    int rollouts;     // rollouts completed within the budget
+    float survival;   // fraction where the building and castle stood
+    float value;      // mean gold + food + wood at the horizon
+    float population; // mean population at the horizon
+} advice_t;
+
+int advisor_rank(const game_t *, uint16_t building,
+                 advice_t *, int max, uint64_t budget, int threads);
@@ -1,10 +1,12 @@
 /**
  * Platform layer. All of the platform specific calls, especially
  * those for communicating with the terminal (the "device"), are
- * captured behind this interface.
+ * captured behind this interface. Terminal state lives in an opaque
+ * device_t so that nothing here is process-global.
  */
 #pragma once
 
+#include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -17,6 +19,10 @@
 #define ARROW_UR 309
 #define ARROW_DR 310
 
+#define KEY_INTERRUPT 3 // ^C, returned instead of exiting
+
+#define DEVICE_FOREVER UINT64_MAX // a device_clock() deadline never reached
+
 #define COLOR_BLACK   0
 #define COLOR_RED     1
 #define COLOR_GREEN   2
@@ -37,21 +43,47 @@ static inline bool
 font_equal(font_t a, font_t b)
 {
     return a.fore == b.fore && a.back == b.back &&
-        a.fore_bright == b.fore_bright && a.back_bright && b.back_bright;
+        a.fore_bright == b.fore_bright && a.back_bright == b.back_bright;
 }
 
-void     device_init(void);
-void     device_free(void);
-void     device_move(int x, int y);
-void     device_cursor_get(int *x, int *y);
-void     device_putc(font_t font, uint16_t c);
-void     device_flush(void);
-int      device_getch(void);
-bool     device_kbhit(uint64_t);
-uint64_t device_uepoch(void);
-void     device_title(const char *);
-void     device_terminal_size(int *, int *);
-void     device_entropy(void *, size_t);
+typedef struct device device_t;
+struct vterm;
+
+/* How well the terminal keeps up with output. */
+typedef struct device_link {
+    uint64_t rate;  // bytes per second it drains, 0 if not measured
+    size_t backlog; // bytes flushed but not yet shown
+    size_t frame;   // average bytes per flush that sent any
+} device_link_t;
+
+device_t *device_init(void);                   // NULL if out of memory
+device_t *device_init_virtual(struct vterm *); // NULL if unsupported, too
+void      device_free(device_t *);
+void      device_move(device_t *, int x, int y);
+int       device_move_cost(device_t *, int x, int y);
+void      device_cursor_get(device_t *, int *x, int *y);
+void      device_putc(device_t *, font_t font, uint16_t c);
+int       device_putc_cost(device_t *, font_t from, font_t font, uint16_t c);
+void      device_flush(device_t *);
+bool      device_cancel(device_t *);
+device_link_t device_link(device_t *);
+int       device_getch(device_t *);
+bool      device_kbhit(device_t *, uint64_t);
+bool      device_kbhit_until(device_t *, uint64_t deadline);
+void      device_title(device_t *, const char *);
+void      device_terminal_size(device_t *, int *, int *);
+
+uint64_t  device_uepoch(void);
+uint64_t  device_clock(void);
+void      device_entropy(void *, size_t);
+int       device_cpu_count(void);
+bool      device_sync(FILE *);
+bool      device_replace(const char *from, const char *to);
+int       device_fork(void);
+void      device_exit(bool success);
+int       device_wait(int pid, bool block);
+const void *device_map(const char *path, size_t *size);
+void      device_unmap(const void *, size_t size);
 
 /* Shorthand Font Literals */
 
@@ -1,49 +1,78 @@
 #include <windows.h>
 #include <conio.h>
+#include <io.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "display.h"
 #include "rand.h"
 #include "device.h"
 
-static CHAR_INFO buffer[DISPLAY_HEIGHT][DISPLAY_WIDTH];
-static HANDLE console_out;
-static HANDLE console_in;
-static int cursor_x, cursor_y;
+struct device {
+    CHAR_INFO buffer[DISPLAY_HEIGHT][DISPLAY_WIDTH];
+    HANDLE console_out;
+    HANDLE console_in;
+    int cursor_x, cursor_y;
+};
 
-void
+device_t *
 device_init(void)
 {
-    console_out = GetStdHandle(STD_OUTPUT_HANDLE);
-    console_in = GetStdHandle(STD_INPUT_HANDLE);
+    device_t *d = calloc(sizeof(*d), 1);
+    if (!d)
+        return NULL;
+    d->console_out = GetStdHandle(STD_OUTPUT_HANDLE);
+    d->console_in = GetStdHandle(STD_INPUT_HANDLE);
     CONSOLE_CURSOR_INFO info = {100, false};
-    SetConsoleCursorInfo(console_out, &info);
+    SetConsoleCursorInfo(d->console_out, &info);
+    return d;
+}
+
+/* The console is driven through its API rather than an escape stream,
+ * so there is nothing for a virtual terminal to interpret. */
+device_t *
+device_init_virtual(struct vterm *vt)
+{
+    (void) vt;
+    return NULL;
 }
 
 void
-device_free(void)
+device_free(device_t *d)
 {
     CONSOLE_CURSOR_INFO info = {100, true};
-    SetConsoleCursorInfo(console_out, &info);
+    SetConsoleCursorInfo(d->console_out, &info);
+    free(d);
 }
 
 void
-device_move(int x, int y)
+device_move(device_t *d, int x, int y)
+{
+    d->cursor_x = x;
+    d->cursor_y = y;
+}
+
+/* Output goes to the console as a whole-screen blit, so moving is
+ * free and skipping a cell always beats rewriting it. */
+int
+device_move_cost(device_t *d, int x, int y)
 {
-    cursor_x = x;
-    cursor_y = y;
+    (void) d;
+    (void) x;
+    (void) y;
+    return 0;
 }
 
 void
-device_cursor_get(int *x, int *y)
+device_cursor_get(device_t *d, int *x, int *y)
 {
     if (x)
-        *x = cursor_x;
+        *x = d->cursor_x;
     if (y)
-        *y = cursor_y;
+        *y = d->cursor_y;
 }
 
 void
-device_putc(font_t font, uint16_t c)
+device_putc(device_t *d, font_t font, uint16_t c)
 {
     WORD color = 0;
     switch (font.fore) {
@@ -106,13 +135,23 @@ device_putc(font_t font, uint16_t c)
         color |= FOREGROUND_INTENSITY;
     if (font.back_bright)
         color |= BACKGROUND_INTENSITY;
-    buffer[cursor_y][cursor_x].Char.UnicodeChar = c;
-    buffer[cursor_y][cursor_x].Attributes = color;
-    cursor_x++;
+    d->buffer[d->cursor_y][d->cursor_x].Char.UnicodeChar = c;
+    d->buffer[d->cursor_y][d->cursor_x].Attributes = color;
+    d->cursor_x++;
+}
+
+int
+device_putc_cost(device_t *d, font_t from, font_t font, uint16_t c)
+{
+    (void) d;
+    (void) from;
+    (void) font;
+    (void) c;
+    return 1;
 }
 
 void
-device_flush(void)
+device_flush(device_t *d)
 {
     COORD size = {
         .X = DISPLAY_WIDTH,
@@ -125,12 +164,30 @@ device_flush(void)
         .Right = DISPLAY_WIDTH,
         .Bottom = DISPLAY_HEIGHT,
     };
-    WriteConsoleOutputW(console_out, buffer[0], size, origin, &area);
+    WriteConsoleOutputW(d->console_out, d->buffer[0], size, origin, &area);
+}
+
+/* Console blits are written as they are flushed, so there is never a
+ * frame left to take back. */
+bool
+device_cancel(device_t *d)
+{
+    (void) d;
+    return false;
+}
+
+/* Nor does the console fall behind. */
+device_link_t
+device_link(device_t *d)
+{
+    (void) d;
+    return (device_link_t){0, 0, 0};
 }
 
 int
-device_getch(void)
+device_getch(device_t *d)
 {
+    (void) d;
     int result = getch();
     if (result != 0xE0 && result != 0x00) {
         return result;
@@ -161,11 +218,11 @@ device_getch(void)
 
 /* http://stackoverflow.com/a/21749034 */
 bool
-device_kbhit(uint64_t useconds)
+device_kbhit(device_t *d, uint64_t useconds)
 {
     DWORD mseconds = useconds / 1000ULL;
     for (;;) {
-        DWORD result = WaitForSingleObject(console_in, mseconds);
+        DWORD result = WaitForSingleObject(d->console_in, mseconds);
         if (result == WAIT_TIMEOUT) {
             return false;
         } else if (_kbhit()) {
@@ -174,13 +231,22 @@ device_kbhit(uint64_t useconds)
             /* Throw away non-input event. */
             INPUT_RECORD r;
             DWORD read;
-            ReadConsoleInput(console_in, &r, 1, &read);
+            ReadConsoleInput(d->console_in, &r, 1, &read);
             continue;
         }
     }
     return false;
 }
 
+bool
+device_kbhit_until(device_t *d, uint64_t deadline)
+{
+    if (deadline == DEVICE_FOREVER)
+        return device_kbhit(d, (uint64_t)INFINITE * 1000);
+    uint64_t now = device_clock();
+    return device_kbhit(d, deadline > now ? deadline - now : 0);
+}
+
 /* http://stackoverflow.com/a/4568846 */
 uint64_t
 device_uepoch(void)
@@ -195,17 +261,28 @@ device_uepoch(void)
     return tt;
 }
 
+uint64_t
+device_clock(void)
+{
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return count.QuadPart / frequency.QuadPart * 1000000 +
+           count.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart;
+}
+
 void
-device_title(const char *title)
+device_title(device_t *d, const char *title)
 {
+    (void) d;
     SetConsoleTitle(title);
 }
 
 void
-device_terminal_size(int *width, int *height)
+device_terminal_size(device_t *d, int *width, int *height)
 {
     CONSOLE_SCREEN_BUFFER_INFO csbi;
-    GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi);
+    GetConsoleScreenBufferInfo(d->console_out, &csbi);
     *width = csbi.srWindow.Right - csbi.srWindow.Left + 1;
     *height = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
 }
@@ -226,3 +303,77 @@ device_entropy(void *buffer, size_t size)
     if (h)
         CryptReleaseContext(h, 0);
 }
+
+int
+device_cpu_count(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+}
+
+bool
+device_sync(FILE *file)
+{
+    HANDLE h = (HANDLE)_get_osfhandle(_fileno(file));
+    return fflush(file) == 0 && FlushFileBuffers(h);
+}
+
+/* Unlike POSIX rename(), MoveFileEx() can replace an existing file. */
+bool
+device_replace(const char *from, const char *to)
+{
+    DWORD flags = MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH;
+    return MoveFileEx(from, to, flags);
+}
+
+/* Windows has no fork(), so background work runs in the foreground. */
+int
+device_fork(void)
+{
+    return -1;
+}
+
+void
+device_exit(bool success)
+{
+    _exit(success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+int
+device_wait(int pid, bool block)
+{
+    (void) pid;
+    (void) block;
+    return 0;
+}
+
+const void *
+device_map(const char *path, size_t *size)
+{
+    HANDLE file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                             OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+    void *map = NULL;
+    DWORD length = GetFileSize(file, NULL);
+    if (length != INVALID_FILE_SIZE && length > 0) {
+        HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY,
+                                           0, 0, NULL);
+        if (mapping) {
+            map = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+            *size = length;
+        }
+    }
+    CloseHandle(file);
+    return map;
+}
+
+void
+device_unmap(const void *map, size_t size)
+{
+    (void) size;
+    if (map)
+        UnmapViewOfFile(map);
+}
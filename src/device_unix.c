@@ -1,115 +1,806 @@
+#define _GNU_SOURCE // ppoll()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <termios.h>
+#include <time.h>
 #include <sys/time.h>
-#include <sys/select.h>
 #include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 #include "device.h"
+#include "display.h"
 #include "rand.h"
 #include "utf.h"
+#include "vterm.h"
 
 #define FONT_INVALID {-1, -1, -1, -1}
-static font_t device_font_last = FONT_INVALID;
-static int cursor_x, cursor_y;
-struct termios termios_orig;
 
-void
+/* Terminal output is built up in one buffer and written out whole by
+ * device_flush(), so a frame costs a single write() however many cells
+ * changed. The buffer is large enough for a complete 80x24 repaint
+ * with a cursor move and color change on every cell.
+ *
+ * On a terminal the writing is done by a writer thread, so that a slow
+ * terminal or link never holds up the game: a flush hands the buffer
+ * over as the pending frame and returns. Until the writer starts on
+ * it, device_cancel() can take the pending frame back, so a newer one
+ * replaces it rather than queueing behind it. Only what the frame
+ * drew is taken back; other output, such as the title, is kept.
+ *
+ * Each frame ends with a cursor position request (DSR), and the
+ * terminal's reply shows that it has shown everything up to there, so
+ * device_link() can tell how much output is still on its way, however
+ * much the kernel, a pty or the network hold in between. Replies that
+ * arrive while the terminal has more queued behind them measure the
+ * rate it drains. A terminal that never replies is measured by the
+ * writer instead: a write only returns once the terminal, or the
+ * buffers in front of it, have taken the bytes, so bytes written over
+ * the time spent writing them is the rate once output backs up. Both
+ * kinds of sample are halved every DRAIN_WINDOW, so that the rate
+ * follows a link that speeds up or slows down. */
+#define OUTPUT_SIZE (1 << 16)
+#define OUTPUT_CELL 24 // worst case bytes for one device_putc()
+#define PROBE "\e[6n"
+#define PROBE_MAX 16 // requests awaiting a reply
+#define DRAIN_WINDOW 2000000 // usec
+#define DRAIN_MIN 100000     // usec of samples needed for a rate
+#define REPLY_WAIT 1000000   // usec device_free() waits for replies
+#define REPLY_FIRST 5000000  // usec before a silent terminal is given up on
+#define REPLY_SPLIT 100000   // usec ESC or ESC [ may be a reply cut short
+
+typedef struct {
+    uint8_t len;
+    char s[11];
+} sgr_t;
+
+/* A cursor position request: where it ends in the output stream. */
+typedef struct {
+    uint64_t offset;
+    uint64_t time; // device_clock() when it was flushed
+} probe_t;
+
+/* Where the cursor and colors stood when a frame began. */
+typedef struct {
+    int x, y;
+    font_t font;
+} frame_start_t;
+
+struct device {
+    int in;
+    int out;
+    vterm_t *vt;            // virtual terminal in place of in and out
+    font_t font_last;
+    int cursor_x, cursor_y; // cursor_x is -1 when the position is unknown
+    struct termios termios_orig;
+    sgr_t sgr[256];     // both colors, indexed by color_index() pairs
+    sgr_t sgr_fore[16]; // foreground only, indexed by color_index()
+    sgr_t sgr_back[16]; // background only
+    char *buffer;       // the frame being built
+    size_t len;
+    size_t keep;        // leading bytes device_cancel() must not drop
+    frame_start_t start;
+    size_t flushed;     // bytes output since the last flush
+    size_t frame;       // average bytes per flush, decaying
+    unsigned char input[64]; // keys read, with the replies taken out
+    size_t input_len;
+    uint64_t input_at;  // device_clock() of the last read
+    /* Acknowledged output */
+    uint64_t sent;      // bytes handed to the terminal
+    uint64_t acked;     // of those, shown by the terminal
+    uint64_t acked_at;  // device_clock() of the last reply
+    uint64_t acks;      // replies, none if the terminal never answers
+    uint64_t probed_at; // device_clock() of the first probe
+    probe_t probes[PROBE_MAX];
+    unsigned probe_first, probe_count;
+    uint64_t ack_bytes; // drained between busy replies lately
+    uint64_t ack_usec;
+    uint64_t ack_epoch;
+    /* Writer thread */
+    bool async;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;  // to the writer: a frame is pending, or quit
+    pthread_cond_t taken; // from the writer: it took the pending frame
+    bool quit;
+    char *pending;        // next to be written, empty if pending_len is 0
+    size_t pending_len;
+    size_t pending_keep;
+    frame_start_t pending_start;
+    char *writing;        // the writer's while it writes
+    size_t writing_len;
+    uint64_t writing_since; // device_clock() when the writer started on it
+    uint64_t drain_bytes; // written lately
+    uint64_t drain_usec;  // time spent writing them
+    uint64_t drain_epoch; // device_clock() when they were last halved
+    char buffers[3][OUTPUT_SIZE];
+};
+
+static int
+color_index(int color, bool bright)
+{
+    return color | bright << 3;
+}
+
+/* The escape that changes the terminal from font FROM to font TO,
+ * touching only the colors that differ. NULL if none do. */
+static const sgr_t *
+sgr_delta(device_t *d, font_t from, font_t to)
+{
+    int fore = color_index(to.fore, to.fore_bright);
+    int back = color_index(to.back, to.back_bright);
+    bool fore_same = from.fore == to.fore && from.fore_bright == to.fore_bright;
+    bool back_same = from.back == to.back && from.back_bright == to.back_bright;
+    if (fore_same && back_same)
+        return NULL;
+    else if (back_same)
+        return d->sgr_fore + fore;
+    else if (fore_same)
+        return d->sgr_back + back;
+    return d->sgr + (fore << 4 | back);
+}
+
+static void
+write_all(int fd, const char *buffer, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = write(fd, buffer + done, len - done);
+        if (r > 0) {
+            done += r;
+        } else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            /* Non-blocking terminal: wait until it drains. */
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            poll(&pfd, 1, -1);
+        } else if (r < 0 && errno != EINTR) {
+            break; // the terminal is gone, drop the output
+        }
+    }
+}
+
+static void *
+writer_main(void *arg)
+{
+    device_t *d = arg;
+    pthread_mutex_lock(&d->lock);
+    for (;;) {
+        while (!d->pending_len && !d->quit)
+            pthread_cond_wait(&d->wake, &d->lock);
+        if (!d->pending_len)
+            break; // quitting, and everything is written
+        char *frame = d->pending;
+        size_t len = d->pending_len;
+        d->pending = d->writing;
+        d->pending_len = 0;
+        d->writing = frame;
+        d->writing_len = len;
+        d->writing_since = device_clock();
+        pthread_cond_broadcast(&d->taken);
+        pthread_mutex_unlock(&d->lock);
+        write_all(d->out, frame, len);
+        uint64_t end = device_clock();
+        pthread_mutex_lock(&d->lock);
+        d->writing_len = 0;
+        d->drain_bytes += len;
+        d->drain_usec += end - d->writing_since + 1;
+        if (end - d->drain_epoch >= DRAIN_WINDOW) {
+            d->drain_bytes /= 2;
+            d->drain_usec /= 2;
+            d->drain_epoch = end;
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+    return NULL;
+}
+
+/* Hand the buffer to the writer as the pending frame. Output flushed
+ * while a frame is still pending joins it, and can no longer be taken
+ * back, waiting for the writer only if both will not fit. */
+static void
+output_queue(device_t *d)
+{
+    pthread_mutex_lock(&d->lock);
+    while (d->pending_len && d->pending_len + d->len > OUTPUT_SIZE)
+        pthread_cond_wait(&d->taken, &d->lock);
+    if (!d->pending_len) {
+        char *swap = d->pending;
+        d->pending = d->buffer;
+        d->buffer = swap;
+        d->pending_len = d->len;
+        d->pending_keep = d->keep;
+        d->pending_start = d->start;
+    } else {
+        memcpy(d->pending + d->pending_len, d->buffer, d->len);
+        d->pending_len += d->len;
+        d->pending_keep = d->pending_len;
+    }
+    pthread_cond_signal(&d->wake);
+    pthread_mutex_unlock(&d->lock);
+}
+
+static void
+output_write(device_t *d)
+{
+    d->flushed += d->len;
+    d->sent += d->len;
+    if (d->vt)
+        vterm_feed(d->vt, d->buffer, d->len);
+    else if (d->async && d->len)
+        output_queue(d);
+    else
+        write_all(d->out, d->buffer, d->len);
+    d->len = 0;
+    d->keep = 0;
+}
+
+/* Make room for N more bytes of output. */
+static char *
+output_reserve(device_t *d, size_t n)
+{
+    if (d->len + n > OUTPUT_SIZE) {
+        output_write(d);
+        d->keep = OUTPUT_SIZE; // the rest of a torn frame must follow it
+    }
+    return d->buffer + d->len;
+}
+
+static void
+output_puts(device_t *d, const char *s)
+{
+    size_t n = strlen(s);
+    if (n > OUTPUT_SIZE)
+        n = OUTPUT_SIZE;
+    memcpy(output_reserve(d, n), s, n);
+    d->len += n;
+    if (d->keep < d->len)
+        d->keep = d->len;
+}
+
+static char *
+put_decimal(char *p, int v)
+{
+    if (v >= 100)
+        *p++ = '0' + v / 100;
+    if (v >= 10)
+        *p++ = '0' + v / 10 % 10;
+    *p++ = '0' + v % 10;
+    return p;
+}
+
+/* Match a cursor position report, ESC [ row ; column R, at the start
+ * of the N bytes at P. Returns its length, 0 if there is none, or -1
+ * if the bytes so far are the start of one. ESC and ESC [ are also
+ * the start of keys, so for them it is -2. */
+static int
+reply_match(const unsigned char *p, size_t n)
+{
+    bool semicolon = false;
+    if ((n > 0 && p[0] != '\e') || (n > 1 && p[1] != '['))
+        return 0;
+    for (size_t i = 2; i < n; i++) {
+        if (p[i] >= '0' && p[i] <= '9')
+            continue;
+        else if (p[i] == ';' && i > 2 && !semicolon)
+            semicolon = true;
+        else if (p[i] == 'R' && semicolon && p[i - 1] != ';')
+            return i + 1;
+        else
+            return 0;
+    }
+    return n > 2 ? -1 : n > 0 ? -2 : 0;
+}
+
+/* The terminal has shown everything up to the oldest probe. */
+static void
+probe_ack(device_t *d)
+{
+    if (!d->probe_count)
+        return; // not ours
+    probe_t *p = d->probes + d->probe_first;
+    d->probe_first = (d->probe_first + 1) % PROBE_MAX;
+    d->probe_count--;
+    uint64_t now = device_clock();
+    if (d->acks && p->time < d->acked_at) {
+        /* All of it was already queued at the last reply, so the
+         * terminal has been busy since. */
+        d->ack_bytes += p->offset - d->acked;
+        d->ack_usec += now - d->acked_at;
+    }
+    if (now - d->ack_epoch >= DRAIN_WINDOW) {
+        d->ack_bytes /= 2;
+        d->ack_usec /= 2;
+        d->ack_epoch = now;
+    }
+    d->acked = p->offset;
+    d->acked_at = now;
+    d->acks++;
+}
+
+/* Take the terminal's replies out of the input. */
+static void
+input_replies(device_t *d)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < d->input_len;) {
+        int n = reply_match(d->input + i, d->input_len - i);
+        if (n > 0) {
+            probe_ack(d);
+            i += n;
+        } else {
+            d->input[len++] = d->input[i++];
+        }
+    }
+    d->input_len = len;
+}
+
+/* Whether input ending in ESC or ESC [ may yet become a reply: only
+ * while one is due, and for REPLY_SPLIT after the read that ended it. */
+static bool
+input_split(device_t *d)
+{
+    return d->probe_count && device_clock() - d->input_at < REPLY_SPLIT;
+}
+
+/* Bytes of input that are keys, short of a reply still arriving. */
+static size_t
+input_keys(device_t *d)
+{
+    for (size_t i = 0; i < d->input_len; i++) {
+        int n = reply_match(d->input + i, d->input_len - i);
+        if (n == -1 || (n == -2 && input_split(d)))
+            return i;
+    }
+    return d->input_len;
+}
+
+/* Wait until DEADLINE for input and read what there is of it. False
+ * on timeout, error or end of input. */
+static bool
+input_poll(device_t *d, uint64_t deadline)
+{
+    if (d->input_len == sizeof(d->input))
+        return true;
+    for (;;) {
+        struct timespec ts;
+        struct timespec *timeout = NULL;
+        if (deadline != DEVICE_FOREVER) {
+            uint64_t now = device_clock();
+            uint64_t left = deadline > now ? deadline - now : 0;
+            ts.tv_sec = left / 1000000;
+            ts.tv_nsec = left % 1000000 * 1000;
+            timeout = &ts;
+        }
+        struct pollfd pfd = {d->in, POLLIN, 0};
+        int r = ppoll(&pfd, 1, timeout, NULL);
+        if (r > 0)
+            break;
+        else if (r == 0 || errno != EINTR)
+            return false;
+    }
+    ssize_t n = read(d->in, d->input + d->input_len,
+                     sizeof(d->input) - d->input_len);
+    if (n <= 0)
+        return false;
+    d->input_len += n;
+    d->input_at = device_clock();
+    input_replies(d);
+    return true;
+}
+
+/* Wait until DEADLINE for keys, letting go of a held ESC or ESC [ as
+ * keys once the rest of a reply is overdue. False on timeout, error
+ * or end of input. */
+static bool
+input_wait(device_t *d, uint64_t deadline)
+{
+    while (!input_keys(d)) {
+        uint64_t until = deadline;
+        uint64_t release = d->input_at + REPLY_SPLIT;
+        if (input_split(d) && release < deadline)
+            until = release;
+        if (!input_poll(d, until) && (until == deadline ||
+                                      device_clock() < until))
+            return false;
+    }
+    return true;
+}
+
+static device_t *
+device_create(vterm_t *vt)
+{
+    device_t *d = malloc(sizeof(*d));
+    if (!d)
+        return NULL;
+    d->in = STDIN_FILENO;
+    d->out = STDOUT_FILENO;
+    d->vt = vt;
+    d->font_last = (font_t)FONT_INVALID;
+    d->cursor_x = -1;
+    d->cursor_y = 0;
+    d->buffer = d->buffers[0];
+    d->len = 0;
+    d->keep = 0;
+    d->start = (frame_start_t){d->cursor_x, d->cursor_y, d->font_last};
+    d->flushed = 0;
+    d->frame = 0;
+    d->input_len = 0;
+    d->input_at = 0;
+    d->sent = 0;
+    d->acked = 0;
+    d->acked_at = 0;
+    d->acks = 0;
+    d->probed_at = 0;
+    d->probe_first = 0;
+    d->probe_count = 0;
+    d->ack_bytes = 0;
+    d->ack_usec = 0;
+    d->ack_epoch = device_clock();
+    d->async = false;
+    d->pending = d->buffers[1];
+    d->pending_len = 0;
+    d->writing = d->buffers[2];
+    d->writing_len = 0;
+    d->drain_bytes = 0;
+    d->drain_usec = 0;
+    d->drain_epoch = device_clock();
+    for (int i = 0; i < 16; i++) {
+        int fore = (i & 7) + (i & 8 ? 90 : 30);
+        int back = (i & 7) + (i & 8 ? 100 : 40);
+        sgr_t *f = d->sgr_fore + i;
+        sgr_t *b = d->sgr_back + i;
+        f->len = snprintf(f->s, sizeof(f->s), "\e[%dm", fore);
+        b->len = snprintf(b->s, sizeof(b->s), "\e[%dm", back);
+        for (int j = 0; j < 16; j++) {
+            sgr_t *both = d->sgr + (i << 4 | j);
+            int back = (j & 7) + (j & 8 ? 100 : 40);
+            both->len = snprintf(both->s, sizeof(both->s),
+                                 "\e[%d;%dm", fore, back);
+        }
+    }
+    output_puts(d, "\e[2J");
+    return d;
+}
+
+device_t *
 device_init(void)
 {
-    printf("\e[2J");
-    tcgetattr(STDIN_FILENO, &termios_orig);
+    fflush(stdout); // anything printed before the device took over
+    device_t *d = device_create(NULL);
+    if (!d)
+        return NULL;
+    tcgetattr(d->in, &d->termios_orig);
     struct termios raw;
-    memcpy(&raw, &termios_orig, sizeof(raw));
+    memcpy(&raw, &d->termios_orig, sizeof(raw));
     raw.c_iflag &= ~(IGNBRK|BRKINT|PARMRK|ISTRIP|INLCR|IGNCR|ICRNL|IXON);
     raw.c_oflag &= ~OPOST;
     raw.c_lflag &= ~(ECHO|ECHONL|ICANON|ISIG|IEXTEN);
     raw.c_cflag &= ~(CSIZE|PARENB);
     raw.c_cflag |= CS8;
-    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
-    fputs("\e[?25l", stdout);
+    tcsetattr(d->in, TCSANOW, &raw);
+    output_puts(d, "\e[?25l");
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->wake, NULL);
+    pthread_cond_init(&d->taken, NULL);
+    d->quit = false;
+    d->async = pthread_create(&d->writer, NULL, writer_main, d) == 0;
+    return d;
+}
+
+/* A device that renders onto VT and reads its scripted keys instead of
+ * using the terminal. */
+device_t *
+device_init_virtual(vterm_t *vt)
+{
+    device_t *d = device_create(vt);
+    if (!d)
+        return NULL;
+    output_puts(d, "\e[?25l");
+    return d;
 }
 
 void
-device_free(void)
+device_free(device_t *d)
 {
-    tcsetattr(STDIN_FILENO, TCSANOW, &termios_orig);
-    printf("\e[?25h\e[m\n");
+    output_puts(d, "\e[?25h\e[m\n");
+    output_write(d);
+    if (d->async) {
+        pthread_mutex_lock(&d->lock);
+        d->quit = true;
+        pthread_cond_signal(&d->wake);
+        pthread_mutex_unlock(&d->lock);
+        pthread_join(d->writer, NULL); // once everything is written
+    }
+    if (!d->vt) {
+        pthread_cond_destroy(&d->taken);
+        pthread_cond_destroy(&d->wake);
+        pthread_mutex_destroy(&d->lock);
+        /* Collect the replies still to come, so that they do not turn
+         * up as input once the terminal is restored. */
+        uint64_t limit = device_clock() + REPLY_WAIT;
+        while (d->acks && d->probe_count && input_poll(d, limit))
+            d->input_len = 0;
+        tcsetattr(d->in, TCSANOW, &d->termios_orig);
+        if (d->probe_count)
+            tcflush(d->in, TCIFLUSH);
+    }
+    free(d);
+}
+
+/* Cursor motion: choose whichever is shortest of absolute addressing
+ * (CUP) and relative motion (CR, LF and the cursor keys). Relative
+ * motion needs a known cursor, and after writing the last column the
+ * cursor may be parked past it waiting to wrap, where only CR is
+ * reliable. LF is only used to move within the display, so it cannot
+ * scroll the screen. */
+
+static char *
+put_csi(char *p, int n, char final)
+{
+    *p++ = '\e';
+    *p++ = '[';
+    if (n != 1)
+        p = put_decimal(p, n);
+    *p++ = final;
+    return p;
+}
+
+static char *
+put_column(char *p, int from, int to)
+{
+    if (to > from)
+        p = put_csi(p, to - from, 'C');
+    else if (to < from)
+        p = put_csi(p, from - to, 'D');
+    return p;
+}
+
+/* Encode the cheapest move to (X, Y) into OUT, which needs 32 bytes. */
+static size_t
+move_encode(device_t *d, int x, int y, char *out)
+{
+    char *p = out;
+    *p++ = '\e';
+    *p++ = '[';
+    p = put_decimal(p, y + 1);
+    if (x > 0) {
+        *p++ = ';';
+        p = put_decimal(p, x + 1);
+    }
+    *p++ = 'H';
+    size_t best = p - out;
+    if (d->cursor_x < 0)
+        return best;
+
+    char rel[32];
+    p = rel;
+    int dy = y - d->cursor_y;
+    if (dy < 0)
+        p = put_csi(p, -dy, 'A');
+    else if (dy > 0 && dy <= 3 && y < DISPLAY_HEIGHT)
+        while (dy--)
+            *p++ = '\n';
+    else if (dy > 0)
+        p = put_csi(p, dy, 'B');
+    bool parked = d->cursor_x >= DISPLAY_WIDTH;
+    *p = '\r';
+    size_t n = put_column(p + 1, 0, x) - p;
+    if (!parked) {
+        char direct[16];
+        size_t m = put_column(direct, d->cursor_x, x) - direct;
+        if (m < n) {
+            memcpy(p, direct, m);
+            n = m;
+        }
+    }
+    p += n;
+    if ((size_t)(p - rel) < best) {
+        best = p - rel;
+        memcpy(out, rel, best);
+    }
+    return best;
 }
 
 void
-device_move(int x, int y)
+device_move(device_t *d, int x, int y)
+{
+    if (x == d->cursor_x && y == d->cursor_y)
+        return;
+    char *p = output_reserve(d, 32);
+    d->len += move_encode(d, x, y, p);
+    d->cursor_x = x;
+    d->cursor_y = y;
+}
+
+/* Bytes device_move() would send for this move. */
+int
+device_move_cost(device_t *d, int x, int y)
 {
-    cursor_x = x;
-    cursor_y = y;
-    device_font_last = (font_t)FONT_INVALID;
-    printf("\e[%d;%dH", y + 1, x + 1);
+    if (x == d->cursor_x && y == d->cursor_y)
+        return 0;
+    char scratch[32];
+    return move_encode(d, x, y, scratch);
 }
 
 void
-device_cursor_get(int *x, int *y)
+device_cursor_get(device_t *d, int *x, int *y)
 {
     if (x)
-        *x = cursor_x;
+        *x = d->cursor_x;
     if (y)
-        *y = cursor_y;
+        *y = d->cursor_y;
 }
 
 void
-device_putc(font_t font, uint16_t c)
+device_putc(device_t *d, font_t font, uint16_t c)
 {
-    uint8_t utf8[7];
-    utf8[utf32_to_8(c, utf8)] = '\0';
-    if (font_equal(device_font_last, font))
-        fputs((char *)utf8, stdout);
-    else
-        printf("\e[%d;%dm%s",
-               font.fore + 30 + (font.fore_bright ? 60 : 0),
-               font.back + 40 + (font.back_bright ? 60 : 0),
-               (char *)utf8);
-    device_font_last = font;
-    cursor_x++;
+    char *p = output_reserve(d, OUTPUT_CELL);
+    char *start = p;
+    const sgr_t *sgr = sgr_delta(d, d->font_last, font);
+    if (sgr) {
+        memcpy(p, sgr->s, sizeof(sgr->s));
+        p += sgr->len;
+    }
+    p += utf32_to_8(c, (uint8_t *)p);
+    d->len += p - start;
+    d->font_last = font;
+    d->cursor_x++;
+}
+
+/* Bytes device_putc() would send for C in FONT after a glyph in FROM. */
+int
+device_putc_cost(device_t *d, font_t from, font_t font, uint16_t c)
+{
+    uint8_t utf8[4];
+    const sgr_t *sgr = sgr_delta(d, from, font);
+    return (sgr ? sgr->len : 0) + utf32_to_8(c, utf8);
+}
+
+/* Ask the terminal to report once it has shown the output so far. */
+static void
+probe_send(device_t *d)
+{
+    if (d->probe_count == PROBE_MAX)
+        return;
+    memcpy(output_reserve(d, 4), PROBE, 4);
+    d->len += 4;
+    uint64_t now = device_clock();
+    unsigned last = (d->probe_first + d->probe_count++) % PROBE_MAX;
+    d->probes[last] = (probe_t){d->sent + d->len, now};
+    if (!d->probed_at)
+        d->probed_at = now;
 }
 
 void
-device_flush(void)
+device_flush(device_t *d)
 {
-    fflush(stdout);
+    if (!d->vt && d->flushed + d->len)
+        probe_send(d);
+    output_write(d);
+    d->start = (frame_start_t){d->cursor_x, d->cursor_y, d->font_last};
+    if (d->flushed)
+        d->frame = (d->frame * 7 + d->flushed) / 8;
+    d->flushed = 0;
+    if (d->vt)
+        vterm_frame(d->vt);
 }
 
-int
-device_getch(void)
-{
-    int r;
-    unsigned char c;
-    if ((r = read(STDIN_FILENO, &c, sizeof(c))) < 0) {
-        return r;
-    } else if (c == '\e') {
-        if (!device_kbhit(0))
-            return c;
-        unsigned char code[2];
-        read(STDIN_FILENO, code, sizeof(code));
-        return code[1] + 256;
-    } else {
-        if (c == 3) {
-            /* SIGINT */
-            device_free();
-            exit(EXIT_FAILURE);
+/* Take back the pending frame if the writer has not started on it, and
+ * put the cursor and colors back where it began, so the next frame can
+ * be drawn in its place. False if there is no such frame. */
+bool
+device_cancel(device_t *d)
+{
+    if (!d->async)
+        return false;
+    pthread_mutex_lock(&d->lock);
+    size_t keep = d->pending_keep;
+    bool cancel = d->pending_len > keep && d->len + keep <= OUTPUT_SIZE;
+    if (cancel) {
+        /* Output to keep goes ahead of anything since the flush. */
+        memmove(d->buffer + keep, d->buffer, d->len);
+        memcpy(d->buffer, d->pending, keep);
+        d->len += keep;
+        d->keep += keep;
+        /* Kept output is counted again as it goes back out, and the
+         * frame's probe goes with the frame. */
+        d->sent -= d->pending_len;
+        while (d->probe_count) {
+            unsigned last = (d->probe_first + d->probe_count - 1) % PROBE_MAX;
+            if (d->probes[last].offset <= d->sent)
+                break;
+            d->probe_count--;
+        }
+        d->pending_len = 0;
+        d->start = d->pending_start;
+        d->cursor_x = d->start.x;
+        d->cursor_y = d->start.y;
+        d->font_last = d->start.font;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return cancel;
+}
+
+/* A rate of 0 means the terminal keeps up, or shows no sign of it.
+ * Until its first reply, all output counts as backlog. */
+device_link_t
+device_link(device_t *d)
+{
+    device_link_t link = {0, 0, d->frame};
+    bool waiting = d->probed_at && device_clock() - d->probed_at < REPLY_FIRST;
+    if (d->acks || waiting) {
+        if (d->ack_usec >= DRAIN_MIN)
+            link.rate = d->ack_bytes * 1000000 / d->ack_usec;
+        link.backlog = d->sent - d->acked;
+        if (d->acks && !d->probe_count && link.backlog) {
+            /* Output flushed while no probe could be sent */
+            probe_send(d);
+            d->keep = d->len;
+            output_write(d);
         }
-        return c;
+        return link;
+    } else if (!d->async) {
+        return link;
+    }
+    pthread_mutex_lock(&d->lock);
+    uint64_t usec = d->drain_usec;
+    if (d->writing_len)
+        usec += device_clock() - d->writing_since; // and counting
+    if (usec)
+        link.rate = d->drain_bytes * 1000000 / usec;
+    link.backlog = d->pending_len + d->writing_len;
+    pthread_mutex_unlock(&d->lock);
+    return link;
+}
+
+int
+device_getch(device_t *d)
+{
+    if (d->vt) {
+        int c = vterm_getc(d->vt);
+        if (c != '\e' || !vterm_pending(d->vt))
+            return c < 0 ? KEY_INTERRUPT : c;
+        vterm_getc(d->vt);
+        c = vterm_getc(d->vt);
+        return c < 0 ? KEY_INTERRUPT : c + 256;
+    }
+    if (!input_wait(d, DEVICE_FOREVER))
+        return -1;
+    int c = d->input[0];
+    size_t used = 1;
+    if (c == '\e' && input_keys(d) < 2)
+        input_poll(d, device_clock()); // the rest of a key comes with it
+    if (c == '\e' && input_keys(d) > 1) {
+        while (input_keys(d) < 3)
+            if (!input_poll(d, DEVICE_FOREVER))
+                return -1;
+        c = d->input[2] + 256;
+        used = 3;
     }
+    d->input_len -= used;
+    memmove(d->input, d->input + used, d->input_len);
+    return c;
 }
 
-/* http://stackoverflow.com/questions/448944/c-non-blocking-keyboard-input */
 bool
-device_kbhit(uint64_t useconds)
+device_kbhit(device_t *d, uint64_t useconds)
 {
-    struct timeval tv = {useconds / 1000000, useconds % 1000000};
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(STDIN_FILENO, &fds);
-    return select(1, &fds, NULL, NULL, &tv) > 0;
+    return device_kbhit_until(d, device_clock() + useconds);
+}
+
+/* Wait for a key until device_clock() reaches DEADLINE. Replies from
+ * the terminal are taken in while waiting, but do not end the wait. */
+bool
+device_kbhit_until(device_t *d, uint64_t deadline)
+{
+    if (d->vt)
+        return true; // a key, or the end of the script, is always ready
+    return input_wait(d, deadline);
 }
 
 uint64_t
@@ -120,17 +811,33 @@ device_uepoch(void)
     return 1000000LL * tv.tv_sec + tv.tv_usec;
 }
 
+/* Microseconds on a clock that never jumps, for pacing. */
+uint64_t
+device_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1000000ULL * ts.tv_sec + ts.tv_nsec / 1000;
+}
+
 void
-device_title(const char *title)
+device_title(device_t *d, const char *title)
 {
-    printf("\e]2;%s\a", title);
+    output_puts(d, "\e]2;");
+    output_puts(d, title);
+    output_puts(d, "\a");
 }
 
 void
-device_terminal_size(int *width, int *height)
+device_terminal_size(device_t *d, int *width, int *height)
 {
+    if (d->vt) {
+        *width = DISPLAY_WIDTH;
+        *height = DISPLAY_HEIGHT;
+        return;
+    }
     struct winsize w;
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+    ioctl(d->out, TIOCGWINSZ, &w);
     *width = w.ws_col;
     *height = w.ws_row;
 }
@@ -148,3 +855,77 @@ device_entropy(void *buffer, size_t size)
     if (in)
         fclose(in);
 }
+
+int
+device_cpu_count(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+}
+
+/* Flush a stream all the way to stable storage. */
+bool
+device_sync(FILE *file)
+{
+    return fflush(file) == 0 && fsync(fileno(file)) == 0;
+}
+
+/* Atomically replace TO with FROM. */
+bool
+device_replace(const char *from, const char *to)
+{
+    return rename(from, to) == 0;
+}
+
+/* Start a copy-on-write child process. Returns 0 in the child, the
+ * child's id in the parent, or -1 if that is not possible. */
+int
+device_fork(void)
+{
+    return fork();
+}
+
+/* Leave a forked child without flushing stdio buffers it shares with
+ * the parent, such as pending terminal output. */
+void
+device_exit(bool success)
+{
+    _exit(success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/* Reap a forked child: 1 if it succeeded, 0 if it failed, or -1 if it
+ * is still running and BLOCK is false. */
+int
+device_wait(int pid, bool block)
+{
+    int status;
+    pid_t result = waitpid(pid, &status, block ? 0 : WNOHANG);
+    if (result == 0)
+        return -1;
+    return result == pid && WIFEXITED(status) &&
+           WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+/* Map a whole file read-only. Returns NULL for missing or empty files. */
+const void *
+device_map(const char *path, size_t *size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat info;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        *size = info.st_size;
+        map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+void
+device_unmap(const void *map, size_t size)
+{
+    if (map)
+        munmap((void *)map, size);
+}
@@ -2,236 +2,534 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <string.h>
-#include <ctype.h>
 #include <assert.h>
 #include "display.h"
 #include "utf.h"
 
-static struct {
-    struct {
-        uint16_t c;
-        font_t font;
-    } current[DISPLAY_WIDTH][DISPLAY_HEIGHT];
-    panel_t base;
-    panel_t *panels;
-} display;
+/* Dirty Rows */
+
+static void
+dirty_reset(dirty_t *rows)
+{
+    for (int y = 0; y < DISPLAY_HEIGHT; y++)
+        rows[y] = (dirty_t){DISPLAY_WIDTH, 0};
+}
+
+static inline void
+dirty_add(dirty_t *row, int lo, int hi)
+{
+    if (lo < row->lo)
+        row->lo = lo;
+    if (hi > row->hi)
+        row->hi = hi;
+}
+
+static void
+dirty_rect(dirty_t *rows, int x, int y, int w, int h)
+{
+    int x0 = x < 0 ? 0 : x;
+    int x1 = x + w > DISPLAY_WIDTH ? DISPLAY_WIDTH : x + w;
+    int y0 = y < 0 ? 0 : y;
+    int y1 = y + h > DISPLAY_HEIGHT ? DISPLAY_HEIGHT : y + h;
+    if (x0 < x1)
+        for (int ty = y0; ty < y1; ty++)
+            dirty_add(rows + ty, x0, x1);
+}
+
+/* The part of SPAN not under the solid span HIDDEN, as far as one span
+ * can tell: trimmed where HIDDEN covers an end, empty if it covers all. */
+static dirty_t
+dirty_visible(dirty_t span, dirty_t hidden)
+{
+    if (hidden.lo <= span.lo && span.lo < hidden.hi)
+        span.lo = hidden.hi;
+    if (hidden.lo < span.hi && span.hi <= hidden.hi)
+        span.hi = hidden.lo;
+    return span;
+}
+
+/* Grow the solid span HIDDEN by columns [LO, HI) where they touch, or
+ * keep whichever is wider where they don't. */
+static void
+hidden_add(dirty_t *hidden, int lo, int hi)
+{
+    lo = lo < 0 ? 0 : lo;
+    hi = hi > DISPLAY_WIDTH ? DISPLAY_WIDTH : hi;
+    if (lo <= hidden->hi && hi >= hidden->lo)
+        dirty_add(hidden, lo, hi);
+    else if (hi - lo > hidden->hi - hidden->lo)
+        *hidden = (dirty_t){lo, hi};
+}
+
+/* Tile Arena */
+
+/* A panel freed out of order is reclaimed once everything above it is
+ * gone. Tiles spill to the heap if the arena runs out. An arena, like
+ * its display, belongs to one thread. */
+
+static cell_t *
+tiles_alloc(tile_arena_t *a, size_t n)
+{
+    if (a->count == ARENA_BLOCKS || a->top + n > ARENA_TILES)
+        return malloc(sizeof(cell_t) * n);
+    a->blocks[a->count].start = a->top;
+    a->blocks[a->count].live = true;
+    a->count++;
+    cell_t *tiles = a->tiles + a->top;
+    a->top += n;
+    return tiles;
+}
+
+static void
+tiles_free(tile_arena_t *a, cell_t *tiles)
+{
+    if (tiles < a->tiles || tiles >= a->tiles + ARENA_TILES) {
+        free(tiles);
+        return;
+    }
+    size_t start = tiles - a->tiles;
+    for (int i = a->count - 1; i >= 0; i--)
+        if (a->blocks[i].start == start)
+            a->blocks[i].live = false;
+    while (a->count > 0 && !a->blocks[a->count - 1].live)
+        a->top = a->blocks[--a->count].start;
+}
+
+/* The tile at screen position (X, Y), or NULL outside the panel. */
+static inline cell_t *
+panel_tile(panel_t *p, int x, int y)
+{
+    x -= p->x;
+    y -= p->y;
+    if (x < 0 || x >= p->w || y < 0 || y >= p->h)
+        return NULL;
+    return p->tiles + y * p->w + x;
+}
+
+/* Display */
+
+#define CELL_UNKNOWN UINT32_MAX // not yet drawn, unlike any composed cell
 
 void
-display_init(void)
+display_init(display_t *d, device_t *device)
 {
-    device_init();
-    panel_init(&display.base, 0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT);
+    d->device = device;
+    d->arena.top = 0;
+    d->arena.count = 0;
+    dirty_reset(d->dirty);
+    panel_init(&d->base, d, 0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT);
     for (int y = 0; y < DISPLAY_HEIGHT; y++)
         for (int x = 0; x < DISPLAY_WIDTH; x++)
-            panel_putc(&display.base, x, y, FONT_DEFAULT, ' ');
-    display.panels = &display.base;
-    display_refresh();
+            panel_putc(&d->base, x, y, FONT_DEFAULT, ' ');
+    d->panels = &d->base;
+    display_invalidate(d);
+    display_refresh(d);
 }
 
 void
-display_free()
+display_free(display_t *d)
 {
-    device_move(0, DISPLAY_HEIGHT);
-    panel_free(&display.base);
-    device_free();
-    assert(display.panels == &display.base);
+    if (d->device) {
+        device_move(d->device, 0, DISPLAY_HEIGHT);
+        device_flush(d->device);
+    }
+    panel_free(&d->base);
+    assert(d->panels == &d->base);
 }
 
 void
-display_push(panel_t *p)
+display_push(display_t *d, panel_t *p)
 {
-    p->next = display.panels;
-    display.panels = p;
+    p->next = d->panels;
+    d->panels = p;
+    dirty_rect(d->dirty, p->x, p->y, p->w, p->h);
 }
 
 void
-display_pop(void)
+display_pop(display_t *d)
 {
-    panel_t *discard = display.panels;
-    display.panels = display.panels->next;
+    panel_t *discard = d->panels;
+    dirty_rect(d->dirty, discard->x, discard->y, discard->w, discard->h);
+    d->panels = d->panels->next;
     discard->next = NULL;
 }
 
 void
-display_pop_free(void)
+display_pop_free(display_t *d)
 {
-    panel_t *discard = display.panels;
-    display_pop();
+    panel_t *discard = d->panels;
+    display_pop(d);
     panel_free(discard);
 }
 
+/* True if resending the cells of row Y from FROM up to TO, which are
+ * already on screen, costs no more than moving the cursor past them.
+ * FONT is the font the cursor was left in. */
+static bool
+gap_cheaper(display_t *d, int from, int to, int y, font_t font)
+{
+    int limit = device_move_cost(d->device, to, y);
+    int cost = 0;
+    for (int x = from; x < to && cost <= limit; x++) {
+        cell_t cell = d->current[y][x];
+        if (cell == CELL_UNKNOWN)
+            return false; // never drawn since an invalidate
+        cost += device_putc_cost(d->device, font, cell_font(cell),
+                                 cell_glyph(cell));
+        font = cell_font(cell);
+    }
+    return cost <= limit;
+}
+
+/* Recompute the owners of columns [LO, HI) of row Y, handing each
+ * panel, top down, whichever of its opaque cells are still unowned. */
+static void
+owner_update(display_t *d, int y, int lo, int hi)
+{
+    panel_t **owner = d->owner[y];
+    int left = hi - lo;
+    for (int x = lo; x < hi; x++)
+        owner[x] = NULL;
+    for (panel_t *p = d->panels; left > 0; p = p->next) {
+        if (y < p->y || y >= p->y + p->h)
+            continue;
+        int x0 = p->x > lo ? p->x : lo;
+        int x1 = p->x + p->w < hi ? p->x + p->w : hi;
+        const cell_t *tiles = p->tiles + (y - p->y) * p->w - p->x;
+        for (int x = x0; x < x1; x++) {
+            if (!owner[x] && !(tiles[x] & CELL_TRANSPARENT)) {
+                owner[x] = p;
+                left--;
+            }
+        }
+    }
+}
+
 void
-display_refresh(void)
+display_refresh(display_t *d)
 {
-    int cx = 0;
-    int cy = 0;
-    device_move(cx, cy);
+    if (!d->device)
+        return; // headless, e.g. replaying a recording
+    if (device_cancel(d->device)) {
+        /* The terminal never got the last frame, so this one replaces
+         * it: as far as the diff goes, its cells were never sent. */
+        for (int y = 0; y < DISPLAY_HEIGHT; y++) {
+            if (d->sent[y].lo < d->sent[y].hi) {
+                memcpy(d->current[y], d->prior[y], sizeof(d->current[y]));
+                dirty_add(d->dirty + y, d->sent[y].lo, d->sent[y].hi);
+            }
+        }
+    }
+    dirty_reset(d->sent);
+    int cx = -1;
+    int cy = -1;
+    font_t font = FONT_DEFAULT; // last font sent, once cx >= 0
     for (int y = 0; y < DISPLAY_HEIGHT; y++) {
-        for (int x = 0; x < DISPLAY_WIDTH; x++) {
-            panel_t *p = display.panels;
-            while (p->tiles[x][y].transparent)
-                p = p->next;
-            uint16_t oldc = display.current[x][y].c;
-            uint16_t newc = p->tiles[x][y].c;
-            font_t oldf = display.current[x][y].font;
-            font_t newf = p->tiles[x][y].font;
-            if (oldc != newc || !font_equal(oldf, newf)) {
-                if (cx != x || cy != y)
-                    device_move(cx = x, cy = y);
-                device_putc(newf, newc);
-                display.current[x][y].font = newf;
-                display.current[x][y].c = newc;
-                cx++;
+        /* Only cells some panel touched, or that a push or pop
+         * exposed, can have changed. Only cells where a panel was
+         * pushed or popped, or some tile turned opaque or transparent,
+         * can have changed owner. */
+        dirty_t row = d->dirty[y];
+        dirty_t cover = d->dirty[y];
+        dirty_t hidden = {DISPLAY_WIDTH, 0};
+        for (panel_t *p = d->panels; p; p = p->next) {
+            /* Changes beneath solid rows above are moot. */
+            dirty_t changed = dirty_visible(p->dirty[y], hidden);
+            dirty_t covered = dirty_visible(p->cover[y], hidden);
+            if (changed.lo < changed.hi)
+                dirty_add(&row, changed.lo, changed.hi);
+            if (covered.lo < covered.hi)
+                dirty_add(&cover, covered.lo, covered.hi);
+            p->dirty[y] = (dirty_t){DISPLAY_WIDTH, 0};
+            p->cover[y] = (dirty_t){DISPLAY_WIDTH, 0};
+            if (y >= p->y && y < p->y + p->h && p->opaque[y] == p->w)
+                hidden_add(&hidden, p->x, p->x + p->w);
+        }
+        d->dirty[y] = (dirty_t){DISPLAY_WIDTH, 0};
+        if (cover.lo < cover.hi)
+            owner_update(d, y, cover.lo, cover.hi);
+        if (row.lo >= row.hi)
+            continue;
+
+        /* Compose the span a run of same-owner cells at a time, and
+         * skip it whole if it matches the screen, as it often does
+         * after a redraw of unchanged content. */
+        cell_t line[DISPLAY_WIDTH];
+        for (int x = row.lo; x < row.hi;) {
+            panel_t *p = d->owner[y][x];
+            int end = x + 1;
+            while (end < row.hi && d->owner[y][end] == p)
+                end++;
+            memcpy(line + x, panel_tile(p, x, y), sizeof(cell_t) * (end - x));
+            x = end;
+        }
+        cell_t *current = d->current[y];
+        if (memcmp(line + row.lo, current + row.lo,
+                   sizeof(cell_t) * (row.hi - row.lo)) == 0)
+            continue;
+        for (int x = row.lo; x < row.hi; x++) {
+            if (line[x] == current[x])
+                continue;
+            if (cy == y && cx >= 0 && cx < x &&
+                gap_cheaper(d, cx, x, y, font)) {
+                /* Rewriting the few unchanged cells in between is
+                 * shorter than any escape that skips them. */
+                for (; cx < x; cx++)
+                    device_putc(d->device, font = cell_font(current[cx]),
+                                cell_glyph(current[cx]));
+            } else if (cx != x || cy != y) {
+                device_move(d->device, cx = x, cy = y);
             }
+            device_putc(d->device, font = cell_font(line[x]),
+                        cell_glyph(line[x]));
+            if (d->sent[y].lo >= d->sent[y].hi)
+                memcpy(d->prior[y], current, sizeof(d->prior[y]));
+            dirty_add(d->sent + y, x, x + 1);
+            current[x] = line[x];
+            cx++;
         }
     }
-    device_flush();
+    device_flush(d->device);
 }
 
 void
-display_invalidate(void)
+display_invalidate(display_t *d)
 {
-    memset(display.current, 0, sizeof(display.current));
+    memset(d->current, 0xff, sizeof(d->current)); // CELL_UNKNOWN
+    dirty_reset(d->sent); // nothing to take back, all will be redrawn
+    dirty_rect(d->dirty, 0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT);
 }
 
 int
-display_getch(void)
+display_getch(display_t *d)
 {
-    display_refresh();
-    return device_getch();
+    display_refresh(d);
+    return device_getch(d->device);
 }
 
 /* Panels */
 
-void
-panel_init(panel_t *p, int x, int y, int w, int h)
+/* Set up P with tiles from D's arena. False if there was no memory
+ * for them, leaving P empty: it can still be drawn on, pushed, popped
+ * and freed, but shows nothing. */
+bool
+panel_init(panel_t *p, display_t *d, int x, int y, int w, int h)
 {
     p->x = x;
     p->y = y;
-    p->w = w;
-    p->h = h;
     assert(w <= DISPLAY_WIDTH);
     assert(h <= DISPLAY_HEIGHT);
-    for (int y = 0; y < DISPLAY_HEIGHT; y++)
-        for (int x = 0; x < DISPLAY_WIDTH; x++)
-            p->tiles[x][y].transparent = true;
+    p->arena = &d->arena;
+    p->tiles = tiles_alloc(p->arena, w * h);
+    bool ok = p->tiles != NULL;
+    p->w = ok ? w : 0;
+    p->h = ok ? h : 0;
+    for (int i = 0; i < p->w * p->h; i++)
+        p->tiles[i] = CELL_TRANSPARENT;
+    dirty_reset(p->dirty);
+    dirty_reset(p->cover);
+    memset(p->opaque, 0, sizeof(p->opaque));
     p->next = NULL;
+    return ok;
 }
 
-void
-panel_center_init(panel_t *p, int w, int h)
+bool
+panel_center_init(panel_t *p, display_t *d, int w, int h)
 {
     int x = DISPLAY_WIDTH / 2 - w / 2;
     int y = DISPLAY_HEIGHT / 2 - h / 2;
-    panel_init(p, x, y, w, h);
+    bool ok = panel_init(p, d, x, y, w, h);
     panel_fill(p, FONT_DEFAULT, ' ');
+    return ok;
 }
 
 void
 panel_free(panel_t *p)
 {
-    (void) p;
     assert(p->next == NULL);
+    tiles_free(p->arena, p->tiles);
+    p->tiles = NULL;
 }
 
-void
-panel_putc(panel_t *p, int x, int y, font_t font, uint16_t c)
+/* Store CELL at panel position (X, Y). */
+static inline void
+panel_put(panel_t *p, int x, int y, cell_t cell)
 {
     x += p->x;
     y += p->y;
-    if (x >= 0 && x < p->x + p->w && y >= 0 && y < p->y + p->h) {
-        p->tiles[x][y].transparent = false;
-        p->tiles[x][y].c = c;
-        p->tiles[x][y].font = font;
+    cell_t *tile = panel_tile(p, x, y);
+    if (tile && x >= 0 && y >= 0) {
+        if (*tile == cell)
+            return; // redrawing what is already there is free
+        if (*tile & CELL_TRANSPARENT) {
+            dirty_add(p->cover + y, x, x + 1);
+            p->opaque[y]++;
+        }
+        *tile = cell;
+        dirty_add(p->dirty + y, x, x + 1);
     }
 }
 
 void
-panel_puts(panel_t *p, int x, int y, font_t font, const char *s)
+panel_putc(panel_t *p, int x, int y, font_t font, uint16_t c)
 {
-    for (uint8_t *s8 = (uint8_t *)s; *s8; s8 += utf8_charlen(*s8), x++) {
-        uint32_t c = utf8_to_32(s8);
-        assert(c <= UINT16_MAX);
-        panel_putc(p, x, y, font, c);
+    panel_put(p, x, y, cell_pack(font, c));
+}
+
+/* Decode the glyph at *S and step past it, ASCII without the decoder. */
+static inline uint16_t
+glyph_next(const uint8_t **s)
+{
+    const uint8_t *p = *s;
+    if (*p < 0x80) {
+        *s = p + 1;
+        return *p;
     }
+    size_t len = utf8_charlen(*p);
+    uint32_t c = utf8_to_32(p);
+    assert(c <= UINT16_MAX);
+    *s = p + (len ? len : 1);
+    return c;
+}
 
+void
+panel_puts(panel_t *p, int x, int y, font_t font, const char *s)
+{
+    cell_t cell = cell_pack(font, 0);
+    for (const uint8_t *s8 = (const uint8_t *)s; *s8; x++)
+        panel_put(p, x, y, cell | glyph_next(&s8));
 }
 
+/* Markup: "Xx{...}" sets the foreground X and background x within the
+ * braces, lowercase for normal and uppercase for bright colors, and
+ * directives nest. Other braces are kept as text, though an unmatched
+ * opening brace is dropped. Each color letter maps to 1 + its color
+ * index, brightness in bit 3, so that a directive is two table hits. */
+
+static const uint8_t color_codes[256] = {
+    ['k'] = 1 + COLOR_BLACK,   ['K'] = 9 + COLOR_BLACK,
+    ['r'] = 1 + COLOR_RED,     ['R'] = 9 + COLOR_RED,
+    ['g'] = 1 + COLOR_GREEN,   ['G'] = 9 + COLOR_GREEN,
+    ['y'] = 1 + COLOR_YELLOW,  ['Y'] = 9 + COLOR_YELLOW,
+    ['b'] = 1 + COLOR_BLUE,    ['B'] = 9 + COLOR_BLUE,
+    ['m'] = 1 + COLOR_MAGENTA, ['M'] = 9 + COLOR_MAGENTA,
+    ['c'] = 1 + COLOR_CYAN,    ['C'] = 9 + COLOR_CYAN,
+    ['w'] = 1 + COLOR_WHITE,   ['W'] = 9 + COLOR_WHITE,
+};
+
 static inline bool
-is_color_directive(const char *p)
+is_color_directive(const uint8_t *p)
 {
-    return p[0] && strchr("rgbcmykwRGBCMYKW", p[0]) &&
-           p[1] && strchr("rgbcmykwRGBCMYKW", p[1]) &&
-           p[2] == '{';
+    return color_codes[p[0]] && color_codes[p[1]] && p[2] == '{';
 }
 
-static inline font_t
-font_decode(const char *s)
+/* The directive at S as a cell with no glyph. */
+static inline cell_t
+directive_cell(const uint8_t *s)
 {
-    font_t font;
-    const char *colors = "krgybmcw";
-    font.fore = strchr(colors, tolower((int)s[0])) - colors;
-    font.back = strchr(colors, tolower((int)s[1])) - colors;
-    font.fore_bright = isupper((int)s[0]);
-    font.back_bright = isupper((int)s[1]);
-    return font;
+    int fore = color_codes[s[0]] - 1;
+    int back = color_codes[s[1]] - 1;
+    font_t font = {fore & 7, back & 7, fore >> 3, back >> 3};
+    return cell_pack(font, 0);
 }
 
-void
-panel_printf(panel_t *p, int x, int y, const char *format, ...)
+#define MARKUP_DEPTH 16
+
+/* Directives nested deeper than MARKUP_DEPTH replace the innermost
+ * font rather than stacking, though their braces still match. */
+static void
+panel_markup(panel_t *p, int x, int y, const char *markup)
 {
     int f = 0;
-    font_t font[16] = {FONT_DEFAULT};
-    char buffer[DISPLAY_WIDTH * 6 + 1];
-    va_list ap;
-    va_start(ap, format);
-    vsnprintf(buffer, sizeof(buffer), format, ap);
-    va_end(ap);
+    int over = 0; // directives open past the top of the stack
+    cell_t cell[MARKUP_DEPTH] = {cell_pack(FONT_DEFAULT, 0)};
     int nest = 0;
-    for (char *s = buffer; *s; s += utf8_charlen((uint8_t)*s)) {
-        if (is_color_directive(s)) {
-            font[++f] = font_decode(s);
-            s += 2;
+    for (const uint8_t *s = (const uint8_t *)markup; *s;) {
+        if (*s >= 0x80) {
+            panel_put(p, x++, y, cell[f] | glyph_next(&s));
+        } else if (is_color_directive(s)) {
+            if (f < MARKUP_DEPTH - 1)
+                f++;
+            else
+                over++;
+            cell[f] = directive_cell(s);
+            s += 3;
         } else if (*s == '}' && (nest > 0 || f > 0)) {
             if (nest > 0) {
                 nest--;
-                panel_putc(p, x++, y, font[f], *s);
+                panel_put(p, x++, y, cell[f] | '}');
+            } else if (over > 0) {
+                over--;
             } else {
                 f--;
             }
+            s++;
         } else if (*s == '{') {
             nest++;
+            s++;
         } else {
-            uint32_t c = utf8_to_32((uint8_t *)s);
-            assert(c <= UINT16_MAX);
-            panel_putc(p, x++, y, font[f], c);
+            panel_put(p, x++, y, cell[f] | *s++);
         }
     }
 }
 
+void
+panel_printf(panel_t *p, int x, int y, const char *format, ...)
+{
+    if (!strchr(format, '%')) {
+        panel_markup(p, x, y, format); // nothing to format
+        return;
+    }
+    char buffer[DISPLAY_WIDTH * 6 + 1];
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(buffer, sizeof(buffer), format, ap);
+    va_end(ap);
+    panel_markup(p, x, y, buffer);
+}
+
 void
 panel_attr(panel_t *p, int x, int y, font_t font)
 {
     x += p->x;
     y += p->y;
-    if (x >= 0 && x < DISPLAY_WIDTH && y >= 0 && y < DISPLAY_HEIGHT) {
-        p->tiles[x][y].transparent = false;
-        p->tiles[x][y].font = font;
+    cell_t *tile = panel_tile(p, x, y);
+    if (tile && x >= 0 && y >= 0) {
+        if (*tile & CELL_TRANSPARENT) {
+            dirty_add(p->cover + y, x, x + 1);
+            p->opaque[y]++;
+        }
+        *tile = cell_pack(font, cell_glyph(*tile));
+        dirty_add(p->dirty + y, x, x + 1);
     }
 }
 
 void
 panel_erase(panel_t *p, int x, int y)
 {
-    p->tiles[x][y].transparent = true;
+    x += p->x;
+    y += p->y;
+    cell_t *tile = panel_tile(p, x, y);
+    if (tile && !(*tile & CELL_TRANSPARENT)) {
+        *tile |= CELL_TRANSPARENT;
+        dirty_add(p->dirty + y, x, x + 1);
+        dirty_add(p->cover + y, x, x + 1);
+        p->opaque[y]--;
+    }
 }
 
 void
 panel_clear(panel_t *p)
 {
-    for (int y = 0; y < p->h; y++) {
-        for (int x = 0; x < p->w; x++) {
-            p->tiles[x][y].transparent = true;
+    cell_t *tile = p->tiles;
+    for (int y = p->y; y < p->y + p->h; y++) {
+        for (int x = p->x; x < p->x + p->w; x++, tile++) {
+            if (!(*tile & CELL_TRANSPARENT)) {
+                *tile |= CELL_TRANSPARENT;
+                dirty_add(p->dirty + y, x, x + 1);
+                dirty_add(p->cover + y, x, x + 1);
+                p->opaque[y]--;
+            }
         }
     }
 }
@@ -239,7 +537,8 @@ panel_clear(panel_t *p)
 uint16_t
 panel_getc(panel_t *p, int x, int y)
 {
-    return p->tiles[x + p->x][y + p->y].c;
+    cell_t *tile = panel_tile(p, x + p->x, y + p->y);
+    return tile ? cell_glyph(*tile) : 0;
 }
 
 void
@@ -271,11 +570,13 @@ size_t
 panel_strlen(const char *s)
 {
     size_t count = 0;
-    for (const char *p = s; *p; p += utf8_charlen((uint8_t) *p)) {
-        if (is_color_directive(p))
+    for (const uint8_t *p = (const uint8_t *)s; *p;) {
+        if (is_color_directive(p)) {
             p += 3;
-        else if (*p != '}')
-            count++;
+        } else {
+            count += *p != '}';
+            glyph_next(&p);
+        }
     }
     return count;
 }
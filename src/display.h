@@ -6,27 +6,93 @@
 #define DISPLAY_WIDTH  80
 #define DISPLAY_HEIGHT 24
 
+/* Columns [lo, hi) of one row changed since the last refresh. */
+typedef struct dirty {
+    uint8_t lo, hi;
+} dirty_t;
+
+/* One screen cell packed into a word, so that rows of cells compare
+ * and copy as plain arrays: the glyph in the low 16 bits, then the
+ * foreground and background colors, each with a brightness bit, then
+ * transparency. A transparent panel cell keeps its glyph. */
+typedef uint32_t cell_t;
+
+#define CELL_FONT_SHIFT  16
+#define CELL_TRANSPARENT (UINT32_C(1) << 24)
+
+static inline cell_t
+cell_pack(font_t font, uint16_t c)
+{
+    return (cell_t)c |
+        (cell_t)((font.fore & 7) | font.fore_bright << 3 |
+                 (font.back & 7) << 4 | font.back_bright << 7)
+        << CELL_FONT_SHIFT;
+}
+
+static inline uint16_t
+cell_glyph(cell_t cell)
+{
+    return cell;
+}
+
+static inline font_t
+cell_font(cell_t cell)
+{
+    unsigned bits = cell >> CELL_FONT_SHIFT;
+    return (font_t){bits & 7, bits >> 4 & 7, bits >> 3 & 1, bits >> 7 & 1};
+}
+
+/* Panels come and go in stack order, each screen's panels freed before
+ * those of the screen that opened it, so their tiles are carved from
+ * the top of their display's arena and handed back from the top. */
+#define ARENA_TILES  (DISPLAY_WIDTH * DISPLAY_HEIGHT * 8)
+#define ARENA_BLOCKS 32
+
+typedef struct tile_arena {
+    cell_t tiles[ARENA_TILES];
+    size_t top;
+    int count;
+    struct {
+        size_t start;
+        bool live;
+    } blocks[ARENA_BLOCKS];
+} tile_arena_t;
+
 typedef struct panel {
     int x, y, w, h;
-    struct {
-        uint16_t c;
-        bool transparent;
-        font_t font;
-    } tiles[DISPLAY_WIDTH][DISPLAY_HEIGHT];
+    cell_t *tiles; // w * h, row by row, from the tile arena
+    tile_arena_t *arena;
+    dirty_t dirty[DISPLAY_HEIGHT]; // screen columns, per screen row
+    dirty_t cover[DISPLAY_HEIGHT]; // columns that turned opaque or transparent
+    uint8_t opaque[DISPLAY_HEIGHT]; // opaque tiles per screen row
     struct panel *next;
 } panel_t;
 
-void display_init(void);
-void display_free(void);
-void display_push(panel_t *);
-void display_pop(void);
-void display_pop_free(void);
-void display_refresh(void);
-void display_invalidate(void);
-int  display_getch(void);
-
-void     panel_init(panel_t *, int x, int y, int w, int h);
-void     panel_center_init(panel_t *, int w, int h);
+/* A render target: the panel stack composited onto one device. With a
+ * NULL device the panels are still drawn but never composited. */
+typedef struct display {
+    cell_t current[DISPLAY_HEIGHT][DISPLAY_WIDTH]; // on screen, row by row
+    panel_t *owner[DISPLAY_HEIGHT][DISPLAY_WIDTH]; // topmost opaque panel
+    panel_t base;
+    panel_t *panels;
+    device_t *device;
+    dirty_t dirty[DISPLAY_HEIGHT]; // exposed by pushing and popping panels
+    dirty_t sent[DISPLAY_HEIGHT];  // cells the last frame changed
+    cell_t prior[DISPLAY_HEIGHT][DISPLAY_WIDTH]; // those rows before it
+    tile_arena_t arena; // for the tiles of its panels
+} display_t;
+
+void display_init(display_t *, device_t *);
+void display_free(display_t *);
+void display_push(display_t *, panel_t *);
+void display_pop(display_t *);
+void display_pop_free(display_t *);
+void display_refresh(display_t *);
+void display_invalidate(display_t *);
+int  display_getch(display_t *);
+
+bool     panel_init(panel_t *, display_t *, int x, int y, int w, int h);
+bool     panel_center_init(panel_t *, display_t *, int w, int h);
 void     panel_free(panel_t *);
 void     panel_putc(panel_t *, int x, int y, font_t, uint16_t);
 void     panel_puts(panel_t *, int x, int y, font_t, const char *);
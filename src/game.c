@@ -1,10 +1,155 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <string.h>
+#include <limits.h>
 #include <math.h>
 #include "game.h"
 #include "rand.h"
+#include "serial.h"
+
+/* State Hashing */
+
+/* The tile grid and the hero roster are hashed incrementally as the
+ * XOR of one key per occupied tile or active hero, so a mutation costs
+ * two key computations no matter how large the game is. Everything
+ * else changes every step anyway and is folded in by game_hash(). */
+
+static uint64_t
+hash_mix(uint64_t h, uint64_t v)
+{
+    h ^= v;
+    h *= 0xbf58476d1ce4e5b9;
+    h ^= h >> 31;
+    h *= 0x94d049bb133111eb;
+    return h ^ (h >> 29);
+}
+
+static uint64_t
+hash_double(uint64_t h, double v)
+{
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return hash_mix(h, bits);
+}
+
+static uint64_t
+tile_key(game_t *game, int x, int y)
+{
+    uint16_t building = game->map.high[x][y].building;
+    if (building == C_NONE)
+        return 0;
+    uint64_t h = hash_mix(x * MAP_HEIGHT + y + 1, building);
+    return hash_mix(h, game->map.high[x][y].building_ready);
+}
+
+static void
+tile_set(game_t *game, int x, int y, uint16_t building, long ready)
+{
+    game->tile_hash ^= tile_key(game, x, y);
+    game->map.high[x][y].building = building;
+    game->map.high[x][y].building_ready = ready;
+    game->tile_hash ^= tile_key(game, x, y);
+}
+
+static uint64_t
+hero_key(game_t *game, int i)
+{
+    hero_t *hero = game->heroes + i;
+    if (!hero->active)
+        return 0;
+    uint64_t h = hash_mix(0x4845524f, i);
+    for (const char *c = hero->name; *c; c++)
+        h = hash_mix(h, *c);
+    h = hash_mix(h, hero->hp);
+    h = hash_mix(h, hero->hp_max);
+    h = hash_mix(h, hero->ap);
+    h = hash_mix(h, hero->ap_max);
+    h = hash_mix(h, hero->str);
+    h = hash_mix(h, hero->dex);
+    h = hash_mix(h, hero->mind);
+    return hash_mix(h, hero->squad);
+}
+
+static void
+hero_set(game_t *game, int i, hero_t hero)
+{
+    game->hero_hash ^= hero_key(game, i);
+    game->heroes[i] = hero;
+    game->hero_hash ^= hero_key(game, i);
+}
+
+static uint64_t
+hash_finish(const game_t *game, uint64_t tiles, uint64_t heroes)
+{
+    uint64_t h = hash_mix(tiles, heroes);
+    h = hash_mix(h, game->map_seed);
+    h = hash_mix(h, game->rand_state);
+    h = hash_mix(h, game->time);
+    h = hash_double(h, game->gold);
+    h = hash_double(h, game->wood);
+    h = hash_double(h, game->food);
+    h = hash_double(h, game->population);
+    h = hash_double(h, game->spawn_rate);
+    h = hash_mix(h, game->max_hero);
+    h = hash_mix(h, game->apology_given);
+    for (int i = 0; i < (int)countof(game->events); i++)
+        h = hash_mix(h, game->events[i]);
+    for (int i = 0; i < (int)countof(game->invaders); i++) {
+        const invader_t *v = game->invaders + i;
+        if (v->active) {
+            h = hash_mix(h, i);
+            h = hash_double(h, v->x);
+            h = hash_double(h, v->y);
+            h = hash_double(h, v->tx);
+            h = hash_double(h, v->ty);
+            h = hash_mix(h, v->type);
+            h = hash_mix(h, v->rampage_time);
+            h = hash_mix(h, v->embarked);
+        }
+    }
+    for (int i = 0; i < (int)countof(game->squads); i++) {
+        const squad_t *q = game->squads + i;
+        h = hash_double(h, q->x);
+        h = hash_double(h, q->y);
+        h = hash_mix(h, q->target);
+        h = hash_mix(h, q->member_count);
+    }
+    return h;
+}
+
+/* Hash of the whole game state, cheap enough to take every step. */
+uint64_t
+game_hash(const game_t *game)
+{
+    return hash_finish(game, game->tile_hash, game->hero_hash);
+}
+
+/* The same hash computed from scratch, to check the incremental one. */
+uint64_t
+game_hash_full(game_t *game)
+{
+    uint64_t tiles = 0;
+    for (int x = 0; x < MAP_WIDTH; x++)
+        for (int y = 0; y < MAP_HEIGHT; y++)
+            tiles ^= tile_key(game, x, y);
+    uint64_t heroes = 0;
+    for (int i = 0; i < (int)countof(game->heroes); i++)
+        heroes ^= hero_key(game, i);
+    return hash_finish(game, tiles, heroes);
+}
+
+/* Recompute the incremental hashes after a bulk change. */
+static void
+game_rehash(game_t *game)
+{
+    game->tile_hash = 0;
+    for (int x = 0; x < MAP_WIDTH; x++)
+        for (int y = 0; y < MAP_HEIGHT; y++)
+            game->tile_hash ^= tile_key(game, x, y);
+    game->hero_hash = 0;
+    for (int i = 0; i < (int)countof(game->heroes); i++)
+        game->hero_hash ^= hero_key(game, i);
+}
 
 static bool
 game_event_push(game_t *game, enum game_event event)
@@ -19,26 +164,28 @@ game_event_push(game_t *game, enum game_event event)
 }
 
 hero_t
-game_hero_generate(void)
+game_hero_generate(game_t *game)
 {
+    uint64_t *rng = &game->rand_state;
     hero_t hero;
     memset(&hero, 0, sizeof(hero));
     hero.active = true;
-    rand_name(hero.name, sizeof(hero.name));
-    hero.hp = hero.hp_max = rand_range(10, 20);
-    hero.ap = hero.ap_max = rand_range(20, 40);
-    hero.str = rand_range(10, 18);
-    hero.dex = rand_range(10, 18);
-    hero.mind = rand_range(10, 18);
+    rand_name(rng, hero.name, sizeof(hero.name));
+    hero.hp = hero.hp_max = rand_range_s(rng, 10, 20);
+    hero.ap = hero.ap_max = rand_range_s(rng, 20, 40);
+    hero.str = rand_range_s(rng, 10, 18);
+    hero.dex = rand_range_s(rng, 10, 18);
+    hero.mind = rand_range_s(rng, 10, 18);
     hero.squad = -1;
     return hero;
 }
 
 game_t *
-game_create(uint64_t map_seed)
+game_create(uint64_t map_seed, uint64_t rand_seed)
 {
     game_t *game = calloc(sizeof(*game), 1);
     game->map_seed = map_seed;
+    game->rand_state = rand_seed ? rand_seed : 1;
     game->time = 0;
     game->speed = 1;
     game->gold = INIT_GOLD;
@@ -46,8 +193,8 @@ game_create(uint64_t map_seed)
     game->food = INIT_FOOD;
     game->population = INIT_POPULATION;
     game->spawn_rate = INVADER_SPAWN_RATE;
-    game->map = map_generate(map_seed);
-    game->map->high[CASTLE_X][CASTLE_Y].building = C_CASTLE;
+    map_generate(&game->map, map_seed);
+    game->map.high[CASTLE_X][CASTLE_Y].building = C_CASTLE;
     game->max_hero = MAX_HERO_INIT;
     for (int i = 0; i < (int)countof(game->squads); i++) {
         game->squads[i].x = CASTLE_X;
@@ -55,42 +202,428 @@ game_create(uint64_t map_seed)
         game->squads[i].target = -1;
     }
     for (int i = 0; i < HERO_INIT; i++) {
-        game->heroes[i] = game_hero_generate();
+        game->heroes[i] = game_hero_generate(game);
         game->heroes[i].squad = 0;
     }
     game->squads[0].member_count = HERO_INIT;
+    game_rehash(game);
     return game;
 }
 
+game_t *
+game_clone(const game_t *game)
+{
+    game_t *clone = malloc(sizeof(*clone));
+    if (clone)
+        game_copy(clone, game);
+    return clone;
+}
+
+void
+game_copy(game_t *dst, const game_t *src)
+{
+    memcpy(dst, src, sizeof(*dst));
+}
+
+/* Save Files
+ *
+ * A save is a magic number and format version followed by the game in
+ * varints and little-endian IEEE floats, closed by a CRC-32 of all of
+ * it. Only live entities and non-empty building tiles are stored; the
+ * terrain is regenerated from the map seed once the file has been
+ * fully validated. Derived state (income, squad sizes) is rebuilt on
+ * load, UI state (speed) is not saved, and nothing is copied from the
+ * file into memory unchecked.
+ */
+
+#define SAVE_MAGIC   "GCOM"
+#define SAVE_VERSION 2
+
+static bool
+building_valid(uint64_t building)
+{
+    switch (building) {
+    case C_CASTLE:
+    case C_LUMBERYARD:
+    case C_STABLE:
+    case C_HAMLET:
+    case C_MINE:
+    case C_ROAD:
+    case C_FARM:
+        return true;
+    }
+    return false;
+}
+
+static bool
+squad_idle(const squad_t *squad)
+{
+    return squad->x == CASTLE_X && squad->y == CASTLE_Y && squad->target < 0;
+}
+
+static void
+game_write(game_t *game, serial_t *s)
+{
+    serial_put(s, SAVE_MAGIC, 4);
+    serial_put_uint(s, SAVE_VERSION);
+
+    serial_put_u64(s, game->map_seed);
+    serial_put_u64(s, game->rand_state);
+    serial_put_int(s, game->time);
+    serial_put_double(s, game->gold);
+    serial_put_double(s, game->wood);
+    serial_put_double(s, game->food);
+    serial_put_double(s, game->population);
+    serial_put_float(s, game->spawn_rate);
+    serial_put_uint(s, game->max_hero);
+    serial_put_uint(s, game->apology_given);
+
+    int events = 0;
+    for (int i = 0; i < (int)countof(game->events); i++)
+        if (game->events[i] != EVENT_NONE)
+            events = i + 1;
+    serial_put_uint(s, events);
+    for (int i = 0; i < events; i++)
+        serial_put_uint(s, game->events[i]);
+
+    /* Buildings as (index delta, building, ready time) triples. */
+    const int tiles = MAP_WIDTH * MAP_HEIGHT;
+    int count = 0;
+    for (int i = 0; i < tiles; i++)
+        count += game->map.high[i / MAP_HEIGHT][i % MAP_HEIGHT].building
+                 != C_NONE;
+    serial_put_uint(s, count);
+    for (int i = 0, last = 0; i < tiles; i++) {
+        int x = i / MAP_HEIGHT;
+        int y = i % MAP_HEIGHT;
+        if (game->map.high[x][y].building != C_NONE) {
+            serial_put_uint(s, i - last);
+            serial_put_uint(s, game->map.high[x][y].building);
+            serial_put_int(s, game->map.high[x][y].building_ready);
+            last = i;
+        }
+    }
+
+    count = 0;
+    for (int i = 0; i < (int)countof(game->invaders); i++)
+        count += game->invaders[i].active;
+    serial_put_uint(s, count);
+    for (int i = 0; i < (int)countof(game->invaders); i++) {
+        invader_t *inv = game->invaders + i;
+        if (inv->active) {
+            serial_put_uint(s, i);
+            serial_put_float(s, inv->x);
+            serial_put_float(s, inv->y);
+            serial_put_float(s, inv->tx);
+            serial_put_float(s, inv->ty);
+            serial_put_uint(s, inv->type);
+            serial_put_int(s, inv->rampage_time);
+            serial_put_uint(s, inv->embarked);
+        }
+    }
+
+    count = 0;
+    for (int i = 0; i < (int)countof(game->squads); i++)
+        count += !squad_idle(game->squads + i);
+    serial_put_uint(s, count);
+    for (int i = 0; i < (int)countof(game->squads); i++) {
+        squad_t *squad = game->squads + i;
+        if (!squad_idle(squad)) {
+            serial_put_uint(s, i);
+            serial_put_float(s, squad->x);
+            serial_put_float(s, squad->y);
+            serial_put_int(s, squad->target);
+        }
+    }
+
+    count = 0;
+    for (int i = 0; i < (int)countof(game->heroes); i++)
+        count += game->heroes[i].active;
+    serial_put_uint(s, count);
+    for (int i = 0; i < (int)countof(game->heroes); i++) {
+        hero_t *hero = game->heroes + i;
+        if (hero->active) {
+            size_t len = strlen(hero->name);
+            serial_put_uint(s, i);
+            serial_put_uint(s, len);
+            serial_put(s, hero->name, len);
+            serial_put_int(s, hero->hp);
+            serial_put_int(s, hero->hp_max);
+            serial_put_int(s, hero->ap);
+            serial_put_int(s, hero->ap_max);
+            serial_put_int(s, hero->str);
+            serial_put_int(s, hero->dex);
+            serial_put_int(s, hero->mind);
+            serial_put_int(s, hero->squad);
+        }
+    }
+}
+
 bool
 game_save(game_t *game, FILE *out)
 {
-    if (fwrite(game, sizeof(*game), 1, out) != 1)
-        return false;
-    if (fwrite(game->map->high, sizeof(game->map->high), 1, out) != 1)
+    serial_t s;
+    serial_init(&s, out);
+    game_write(game, &s);
+    serial_put_crc(&s);
+    return serial_ok(&s);
+}
+
+/* CRC-32 of the save encoding: equal for games that would save equal,
+ * regardless of UI-only fields such as the speed. */
+uint32_t
+game_checksum(game_t *game)
+{
+    serial_t s;
+    serial_init(&s, NULL);
+    game_write(game, &s);
+    return s.crc;
+}
+
+/* Read an unsigned value that must be below LIMIT. */
+static uint64_t
+get_below(serial_t *s, uint64_t limit)
+{
+    uint64_t v = serial_get_uint(s);
+    if (v >= limit) {
+        serial_fail(s);
+        return 0;
+    }
+    return v;
+}
+
+/* Read a signed value in [MIN, MAX]. */
+static int64_t
+get_range(serial_t *s, int64_t min, int64_t max)
+{
+    int64_t v = serial_get_int(s);
+    if (v < min || v > max) {
+        serial_fail(s);
+        return min;
+    }
+    return v;
+}
+
+/* Read a finite double: NaN and infinities would spread through the
+ * simulation. */
+static double
+get_double(serial_t *s)
+{
+    double v = serial_get_double(s);
+    if (!isfinite(v)) {
+        serial_fail(s);
+        return 0;
+    }
+    return v;
+}
+
+/* Read a finite float. */
+static float
+get_float(serial_t *s)
+{
+    float v = serial_get_float(s);
+    if (!isfinite(v)) {
+        serial_fail(s);
+        return 0;
+    }
+    return v;
+}
+
+/* Read the next index of a strictly increasing sequence below LIMIT. */
+static int
+get_index(serial_t *s, int *last, int limit)
+{
+    int i = get_below(s, limit);
+    if (i <= *last)
+        serial_fail(s);
+    *last = i;
+    return i;
+}
+
+static bool
+game_read(game_t *game, serial_t *s)
+{
+    char magic[4];
+    serial_get(s, magic, sizeof(magic));
+    if (memcmp(magic, SAVE_MAGIC, 4) != 0 ||
+        serial_get_uint(s) != SAVE_VERSION)
         return false;
-    return true;
+
+    game->map_seed = serial_get_u64(s);
+    game->rand_state = serial_get_u64(s);
+    if (!game->rand_state)
+        serial_fail(s);
+    game->time = get_range(s, 0, LONG_MAX);
+    game->speed = 1;
+    game->gold = get_double(s);
+    game->wood = get_double(s);
+    game->food = get_double(s);
+    game->population = get_double(s);
+    game->spawn_rate = serial_get_float(s);
+    if (!(game->spawn_rate >= 0 && game->spawn_rate <= DAY))
+        serial_fail(s); // NaN too; DAY is an invader every step
+    game->max_hero = get_below(s, countof(game->heroes) + 1);
+    game->apology_given = get_below(s, 2);
+
+    int events = get_below(s, countof(game->events) + 1);
+    for (int i = 0; i < events; i++)
+        game->events[i] = get_below(s, EVENT_BATTLE + 1);
+
+    const int tiles = MAP_WIDTH * MAP_HEIGHT;
+    int count = get_below(s, tiles + 1);
+    int stables = 0;
+    for (int n = 0, i = 0; n < count && serial_ok(s); n++) {
+        i += get_below(s, tiles - i);
+        if (game->map.high[i / MAP_HEIGHT][i % MAP_HEIGHT].building)
+            serial_fail(s);
+        uint64_t building = serial_get_uint(s);
+        if (!building_valid(building))
+            serial_fail(s);
+        stables += building == C_STABLE;
+        game->map.high[i / MAP_HEIGHT][i % MAP_HEIGHT].building = building;
+        game->map.high[i / MAP_HEIGHT][i % MAP_HEIGHT].building_ready =
+            get_range(s, LONG_MIN, LONG_MAX);
+    }
+    /* Every stable built, and only those, added hero slots. */
+    if (game->max_hero != MAX_HERO_INIT + STABLE_INC * stables)
+        serial_fail(s);
+
+    count = get_below(s, countof(game->invaders) + 1);
+    for (int n = 0, last = -1; n < count && serial_ok(s); n++) {
+        invader_t *inv = game->invaders + get_index(s, &last,
+                                                    countof(game->invaders));
+        inv->active = true;
+        inv->x = get_float(s);
+        inv->y = get_float(s);
+        inv->tx = get_float(s);
+        inv->ty = get_float(s);
+        inv->type = get_below(s, UINT16_MAX + 1);
+        inv->rampage_time = get_range(s, LONG_MIN, LONG_MAX);
+        inv->embarked = get_below(s, 2);
+    }
+
+    for (int i = 0; i < (int)countof(game->squads); i++) {
+        game->squads[i].x = CASTLE_X;
+        game->squads[i].y = CASTLE_Y;
+        game->squads[i].target = -1;
+    }
+    count = get_below(s, countof(game->squads) + 1);
+    for (int n = 0, last = -1; n < count && serial_ok(s); n++) {
+        squad_t *squad = game->squads + get_index(s, &last,
+                                                  countof(game->squads));
+        squad->x = get_float(s);
+        squad->y = get_float(s);
+        squad->target = get_range(s, -1, countof(game->invaders) - 1);
+    }
+
+    count = get_below(s, countof(game->heroes) + 1);
+    for (int n = 0, last = -1; n < count && serial_ok(s); n++) {
+        hero_t *hero = game->heroes + get_index(s, &last,
+                                                countof(game->heroes));
+        hero->active = true;
+        size_t len = get_below(s, sizeof(hero->name));
+        serial_get(s, hero->name, len);
+        hero->name[len] = 0;
+        hero->hp = get_range(s, INT_MIN, INT_MAX);
+        hero->hp_max = get_range(s, INT_MIN, INT_MAX);
+        hero->ap = get_range(s, INT_MIN, INT_MAX);
+        hero->ap_max = get_range(s, INT_MIN, INT_MAX);
+        hero->str = get_range(s, INT_MIN, INT_MAX);
+        hero->dex = get_range(s, INT_MIN, INT_MAX);
+        hero->mind = get_range(s, INT_MIN, INT_MAX);
+        hero->squad = get_range(s, -1, countof(game->squads) - 1);
+        if (hero->squad >= 0)
+            game->squads[hero->squad].member_count++;
+    }
+
+    return serial_get_crc(s);
 }
 
-game_t *
-game_load(FILE *out)
+static game_t *
+game_decode(serial_t *s)
 {
-    game_t *game = malloc(sizeof(*game));
-    if (fread(game, sizeof(*game), 1, out) == 1) {
-        game->map = map_generate(game->map_seed);
-        if (fread(game->map->high, sizeof(game->map->high), 1, out) == 1)
-            return game;
+    game_t *game = calloc(sizeof(*game), 1);
+    if (!game)
+        return NULL;
+    map_t *terrain = NULL;
+    if (!game_read(game, s) || !(terrain = malloc(sizeof(*terrain)))) {
+        free(game);
+        return NULL;
     }
-    return NULL;
+    map_generate(terrain, game->map_seed);
+    for (int x = 0; x < MAP_WIDTH; x++)
+        for (int y = 0; y < MAP_HEIGHT; y++)
+            game->map.high[x][y].base = terrain->high[x][y].base;
+    free(terrain);
+    game->income_expires = 0;
+    game_rehash(game);
+    return game;
+}
+
+game_t *
+game_load(FILE *in)
+{
+    serial_t s;
+    serial_init(&s, in);
+    return game_decode(&s);
+}
+
+game_t *
+game_load_buffer(const void *buffer, size_t length)
+{
+    serial_t s;
+    serial_init_buffer(&s, buffer, length);
+    return game_decode(&s);
 }
 
 void
 game_free(game_t *game)
 {
-    map_free(game->map);
     free(game);
 }
 
+/* Snapshot Pool */
+
+bool
+game_pool_init(game_pool_t *pool, int capacity)
+{
+    pool->slots = malloc(sizeof(*pool->slots) * capacity);
+    pool->free = malloc(sizeof(*pool->free) * capacity);
+    if (!pool->slots || !pool->free) {
+        free(pool->slots);
+        free(pool->free);
+        return false;
+    }
+    pool->capacity = capacity;
+    pool->count = capacity;
+    for (int i = 0; i < capacity; i++)
+        pool->free[i] = pool->slots + capacity - i - 1;
+    return true;
+}
+
+void
+game_pool_free(game_pool_t *pool)
+{
+    free(pool->slots);
+    free(pool->free);
+}
+
+game_t *
+game_pool_fork(game_pool_t *pool, const game_t *game)
+{
+    if (pool->count == 0)
+        return NULL;
+    game_t *fork = pool->free[--pool->count];
+    game_copy(fork, game);
+    return fork;
+}
+
+void
+game_pool_release(game_pool_t *pool, game_t *game)
+{
+    pool->free[pool->count++] = game;
+}
+
 static void
 add_population(game_t *game, long amount)
 {
@@ -105,80 +638,71 @@ add_population(game_t *game, long amount)
 }
 
 bool
-game_build(game_t *game, uint16_t building, int x, int y)
+game_can_build(game_t *game, uint16_t building, int x, int y)
 {
-    if (building == C_NONE) {
-        /* Erase */
-        if (game->map->high[x][y].building != C_NONE) {
-            game->map->high[x][y].building = C_NONE;
-            return true;
-        }
-    }
     if (x < 0 || x >= MAP_WIDTH || y < 0 || y >= MAP_HEIGHT ||
-        game->map->high[x][y].building != C_NONE) {
+        game->map.high[x][y].building != C_NONE) {
         return false;
     }
 
     bool valid = false;
-    if (x > 0 && game->map->high[x - 1][y].building != C_NONE)
+    if (x > 0 && game->map.high[x - 1][y].building != C_NONE)
         valid = true;
-    else if (y > 0 && game->map->high[x][y - 1].building != C_NONE)
+    else if (y > 0 && game->map.high[x][y - 1].building != C_NONE)
         valid = true;
-    else if (x + 1 < MAP_WIDTH && game->map->high[x + 1][y].building != C_NONE)
+    else if (x + 1 < MAP_WIDTH && game->map.high[x + 1][y].building != C_NONE)
         valid = true;
-    else if (y + 1 < MAP_HEIGHT && game->map->high[x][y + 1].building != C_NONE)
+    else if (y + 1 < MAP_HEIGHT && game->map.high[x][y + 1].building != C_NONE)
         valid = true;
-    if (valid) {
-        valid = false;
-        enum map_base base = game->map->high[x][y].base;
-        switch (building) {
-        case C_NONE:
-        case C_CASTLE:
-        case C_ROAD:
-            valid = base != BASE_OCEAN && base != BASE_COAST;
-            break;
-        case C_LUMBERYARD:
-            valid = base == BASE_FOREST;
-            break;
-        case C_STABLE:
-            valid = base == BASE_GRASSLAND;
-            game->max_hero += STABLE_INC;
-            break;
-        case C_HAMLET:
-            valid =
-                base == BASE_GRASSLAND ||
-                base == BASE_FOREST ||
-                base == BASE_HILL;
-            if (valid)
-                add_population(game, HAMLET_INC);
-            break;
-        case C_MINE:
-            valid = base == BASE_HILL;
-            break;
-            break;
-        case C_FARM:
-            valid = base == BASE_GRASSLAND || base == BASE_FOREST;
-            break;
+    return valid && building_fits(building, game->map.high[x][y].base);
+}
+
+bool
+game_can_afford(game_t *game, yield_t yield)
+{
+    return
+        (yield.food == 0 || game->food >= yield.food) &&
+        (yield.wood == 0 || game->wood >= yield.wood) &&
+        (yield.gold == 0 || game->gold >= yield.gold);
+}
+
+bool
+game_build(game_t *game, uint16_t building, int x, int y)
+{
+    if (building == C_NONE) {
+        /* Erase */
+        if (map_building(&game->map, x, y) != C_NONE) {
+            tile_set(game, x, y, C_NONE, game->map.high[x][y].building_ready);
+            game->income_expires = 0;
+            return true;
         }
     }
-    if (valid) {
-        yield_t cost = building_cost(building);
-        game->food -= cost.food;
-        game->wood -= cost.wood;
-        game->gold -= cost.gold;
-        game->map->high[x][y].building = building;
-        if (building == C_ROAD)
-            game->map->high[x][y].building_age = 0;
-        else
-            game->map->high[x][y].building_age = INIT_BUILDING_AGE;
+    if (!game_can_build(game, building, x, y))
+        return false;
+    switch (building) {
+    case C_STABLE:
+        game->max_hero += STABLE_INC;
+        break;
+    case C_HAMLET:
+        add_population(game, HAMLET_INC);
+        break;
     }
-    return valid;
+    yield_t cost = building_cost(building);
+    game->food -= cost.food;
+    game->wood -= cost.wood;
+    game->gold -= cost.gold;
+    if (building == C_ROAD)
+        tile_set(game, x, y, building, game->time);
+    else
+        tile_set(game, x, y, building, game->time + BUILD_TIME);
+    game->income_expires = 0;
+    return true;
 }
 
 void
 game_unbuild(game_t *game, int x, int y)
 {
-    uint16_t building = map_building(game->map, x, y);
+    uint16_t building = map_building(&game->map, x, y);
     switch (building) {
     case C_HAMLET:
         add_population(game, -HAMLET_INC);
@@ -196,7 +720,8 @@ game_unbuild(game_t *game, int x, int y)
         add_population(game, -50);
         return; // don't destroy
     }
-    game->map->high[x][y].building = C_NONE;
+    tile_set(game, x, y, C_NONE, game->map.high[x][y].building_ready);
+    game->income_expires = 0;
 }
 
 void
@@ -223,36 +748,32 @@ yield_apply(game_t *game, yield_t yield)
     game->gold += yield.gold / DAY;
 }
 
+/* Daily yield of every producing building. It only changes on
+ * build, unbuild or when construction finishes, so it is cached until
+ * then instead of rescanning the map every second. */
 static void
-building_process(game_t *game, uint16_t building)
+income_update(game_t *game)
 {
-    yield_t yield = {0, 0, 0};
-    switch (building) {
-    case C_NONE:
-        return;
-    case C_CASTLE:
-        yield = YIELD_CASTLE;
-        break;
-    case C_LUMBERYARD:
-        yield = YIELD_LUMBERYARD;
-        break;
-    case C_STABLE:
-        yield = YIELD_STABLE;
-        break;
-    case C_HAMLET:
-        yield = YIELD_HAMLET;
-        break;
-    case C_MINE:
-        yield = YIELD_MINE;
-        break;
-    case C_ROAD:
-        yield = YIELD_ROAD;
-        break;
-    case C_FARM:
-        yield = YIELD_FARM;
-        break;
+    yield_t income = {0, 0, 0};
+    long expires = LONG_MAX;
+    for (int y = 0; y < MAP_HEIGHT; y++) {
+        for (int x = 0; x < MAP_WIDTH; x++) {
+            uint16_t building = game->map.high[x][y].building;
+            long ready = game->map.high[x][y].building_ready;
+            if (building == C_NONE) {
+                continue;
+            } else if (game->time >= ready) {
+                yield_t yield = building_yield(building);
+                income.gold += yield.gold;
+                income.food += yield.food;
+                income.wood += yield.wood;
+            } else if (ready < expires) {
+                expires = ready;
+            }
+        }
     }
-    yield_apply(game, yield);
+    game->income = income;
+    game->income_expires = expires;
 }
 
 void
@@ -282,13 +803,59 @@ game_hero_push(game_t *game, hero_t hero)
 {
     for (int i = 0; i < game->max_hero; i++) {
         if (!game->heroes[i].active) {
-            game->heroes[i] = hero;
+            hero_set(game, i, hero);
             return true;
         }
     }
     return false;
 }
 
+void
+game_hero_candidates(game_t *game, hero_t *heroes, int count)
+{
+    for (int i = 0; i < count; i++)
+        heroes[i] = game_hero_generate(game);
+}
+
+bool
+game_hero_hire(game_t *game, int slot, hero_t hero)
+{
+    if (slot < 0 || slot >= game->max_hero || game->heroes[slot].active ||
+        hero.squad < -1 || hero.squad >= (int)countof(game->squads))
+        return false;
+    hero_set(game, slot, hero);
+    if (hero.squad >= 0)
+        game->squads[hero.squad].member_count++;
+    return true;
+}
+
+bool
+game_hero_assign(game_t *game, int hero, int squad)
+{
+    if (hero < 0 || hero >= (int)countof(game->heroes))
+        return false;
+    hero_t h = game->heroes[hero];
+    if (!h.active || squad < -1 || squad >= (int)countof(game->squads))
+        return false;
+    if (h.squad >= 0)
+        game->squads[h.squad].member_count--;
+    h.squad = squad;
+    if (h.squad >= 0)
+        game->squads[h.squad].member_count++;
+    hero_set(game, hero, h);
+    return true;
+}
+
+bool
+game_squad_order(game_t *game, int squad, int target)
+{
+    if (squad < 0 || squad >= (int)countof(game->squads) ||
+        target < -1 || target >= (int)countof(game->invaders))
+        return false;
+    game->squads[squad].target = target;
+    return true;
+}
+
 enum game_event
 game_event_pop(game_t *game)
 {
@@ -324,9 +891,9 @@ invader_delete(game_t *game, invader_t *i)
 }
 
 static invader_t
-invader_generate(void)
+invader_generate(game_t *game)
 {
-    float az = rand_uniform(0, 2 * PI);
+    float az = rand_uniform_s(&game->rand_state, 0, 2 * PI);
     invader_t invader = {
         .active = true,
         .type = I_GOBLIN,
@@ -340,13 +907,13 @@ invader_generate(void)
 static inline uint16_t
 invader_base(game_t *game, invader_t *i)
 {
-    return map_base(game->map, i->x, i->y);
+    return map_base(&game->map, i->x, i->y);
 }
 
 static inline uint16_t
 invader_building(game_t *game, invader_t *i)
 {
-    return map_building(game->map, i->x, i->y);
+    return map_building(&game->map, i->x, i->y);
 }
 
 static void
@@ -354,14 +921,15 @@ invader_find_target(game_t *game, invader_t *i)
 {
     int ix = i->x;
     int iy = i->y;
-    int best_x = ix + rand_uniform(-INVADER_VISION, INVADER_VISION);
-    int best_y = iy + rand_uniform(-INVADER_VISION, INVADER_VISION);
+    uint64_t *rng = &game->rand_state;
+    int best_x = ix + rand_uniform_s(rng, -INVADER_VISION, INVADER_VISION);
+    int best_y = iy + rand_uniform_s(rng, -INVADER_VISION, INVADER_VISION);
     float best_d = INFINITY;
     for (int y = -INVADER_VISION; y <= INVADER_VISION; y++) {
         for (int x = -INVADER_VISION; x <= INVADER_VISION; x++) {
             float xx = ix + x;
             float yy = iy + y;
-            uint16_t building = map_building(game->map, xx, yy);
+            uint16_t building = map_building(&game->map, xx, yy);
             if (building != C_NONE) {
                 float d = xx * xx + yy * yy;
                 if (d < best_d) {
@@ -381,8 +949,8 @@ invader_step(game_t *game, invader_t *i)
 {
     uint16_t base = invader_base(game, i);
     uint16_t building = invader_building(game, i);
-    uint16_t target_base = map_base(game->map, i->tx, i->ty);
-    uint16_t target_building = map_building(game->map, i->tx, i->ty);
+    uint16_t target_base = map_base(&game->map, i->tx, i->ty);
+    uint16_t target_building = map_building(&game->map, i->tx, i->ty);
     if (i->embarked || game->population >= GAME_WIN_POP) {
         if (IS_WATER(base)) {
             i->tx = CASTLE_X;
@@ -447,7 +1015,7 @@ squad_step(game_t *game, squad_t *squad)
     float dx = tx - squad->x;
     float dy = ty - squad->y;
     float d = sqrt(dx * dx + dy * dy);
-    if (d < 0.1 && !IS_WATER(map_base(game->map, tx, ty))) {
+    if (d < 0.1 && !IS_WATER(map_base(&game->map, tx, ty))) {
         squad->x = tx;
         squad->y = ty;
         if (squad->target >= 0) {
@@ -457,12 +1025,12 @@ squad_step(game_t *game, squad_t *squad)
         }
     } else {
         float speed = SQUAD_SPEED;
-        if (map_base(game->map, squad->x, squad->y) == BASE_MOUNTAIN &&
-            map_building(game->map, squad->x, squad->y) == C_NONE)
+        if (map_base(&game->map, squad->x, squad->y) == BASE_MOUNTAIN &&
+            map_building(&game->map, squad->x, squad->y) == C_NONE)
             speed *= 0.6;
         float newx = squad->x + (speed / (float)DAY) * dx / d;
         float newy = squad->y + (speed / (float)DAY) * dy / d;
-        if (squad->target < 0 || !IS_WATER(map_base(game->map, newx, newy))) {
+        if (squad->target < 0 || !IS_WATER(map_base(&game->map, newx, newy))) {
             squad->x = newx;
             squad->y = newy;
         }
@@ -472,32 +1040,17 @@ squad_step(game_t *game, squad_t *squad)
 yield_t
 game_step(game_t *game)
 {
-    struct {
-        double gold;
-        double food;
-        double wood;
-    } init = {game->gold, game->food, game->wood};
-    for (int y = 0; y < MAP_HEIGHT; y++) {
-        for (int x = 0; x < MAP_WIDTH; x++) {
-            uint16_t building = game->map->high[x][y].building;
-            if (building != C_NONE) {
-                if (++game->map->high[x][y].building_age >= 0)
-                    building_process(game, building);
-            }
-        }
-    }
-    yield_t diff = {
-        .gold = (game->gold - init.gold) * DAY,
-        .food = (game->food - init.food) * DAY,
-        .wood = (game->wood - init.wood) * DAY
-    };
+    if (game->time >= game->income_expires)
+        income_update(game);
+    yield_apply(game, game->income);
+    yield_t diff = game->income;
 
     for (unsigned i = 0; i < countof(game->squads); i++)
         if (game->squads[i].member_count > 0)
             squad_step(game, game->squads + i);
 
-    if (rand_uniform(0, 1) < game->spawn_rate / DAY)
-        invader_push(game, invader_generate());
+    if (rand_uniform_s(&game->rand_state, 0, 1) < game->spawn_rate / DAY)
+        invader_push(game, invader_generate(game));
     for (unsigned i = 0; i < countof(game->invaders); i++)
         if (game->invaders[i].active)
             invader_step(game, game->invaders + i);
@@ -558,6 +1111,31 @@ building_yield(uint16_t building)
     return (yield_t){0, 0, 0};
 }
 
+bool
+building_fits(uint16_t building, uint16_t base)
+{
+    switch (building) {
+    case C_NONE:
+    case C_CASTLE:
+    case C_ROAD:
+        return base != BASE_OCEAN && base != BASE_COAST;
+    case C_LUMBERYARD:
+        return base == BASE_FOREST;
+    case C_STABLE:
+        return base == BASE_GRASSLAND;
+    case C_HAMLET:
+        return
+            base == BASE_GRASSLAND ||
+            base == BASE_FOREST ||
+            base == BASE_HILL;
+    case C_MINE:
+        return base == BASE_HILL;
+    case C_FARM:
+        return base == BASE_GRASSLAND || base == BASE_FOREST;
+    }
+    return false;
+}
+
 void
 game_draw_units(game_t *game, panel_t *p, bool id)
 {
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdio.h>
 #include <stdint.h>
 #include "map.h"
 
@@ -11,7 +12,7 @@
 #define INIT_WOOD         100
 #define INIT_FOOD         10
 #define INIT_POPULATION   250
-#define INIT_BUILDING_AGE (-60 * 60 * 24) // 1 day
+#define BUILD_TIME        (60 * 60 * 24) // 1 day
 #define STABLE_INC        2
 #define HAMLET_INC        200
 
@@ -40,6 +41,7 @@ typedef struct {
 void yield_string(char *, yield_t, bool rate);
 yield_t building_cost(uint16_t);
 yield_t building_yield(uint16_t);
+bool    building_fits(uint16_t building, uint16_t base);
 
 #define GAME_WIN_POP 4000
 
@@ -87,13 +89,16 @@ typedef struct hero {
 
 typedef struct game {
     uint64_t map_seed;
+    uint64_t rand_state;
     long time; // seconds
     int speed;
     double gold;
     double wood;
     double food;
     double population;
-    map_t *map;
+    map_t map;
+    yield_t income;      // cached daily yield of producing buildings
+    long income_expires; // game time when income must be recomputed
     float spawn_rate; // per day
     invader_t invaders[16];
     squad_t squads[16];
@@ -101,19 +106,47 @@ typedef struct game {
     hero_t heroes[128];
     enum game_event events[8];
     bool apology_given;
+    uint64_t tile_hash; // maintained by every tile mutation, see game_hash()
+    uint64_t hero_hash; // maintained by every hero mutation
 } game_t;
 
-game_t *game_create(uint64_t map_seed);
+/* A game_t is one flat allocation with no internal pointers, so it
+ * is snapshotted with a single memcpy. */
+typedef struct game_pool {
+    game_t *slots;
+    game_t **free;
+    int count;
+    int capacity;
+} game_pool_t;
+
+game_t *game_create(uint64_t map_seed, uint64_t rand_seed);
+game_t *game_clone(const game_t *);
+void    game_copy(game_t *dst, const game_t *src);
 bool    game_save(game_t *game, FILE *out);
-game_t *game_load(FILE *out);
+game_t *game_load(FILE *in);
+game_t *game_load_buffer(const void *, size_t);
+uint32_t game_checksum(game_t *);
+uint64_t game_hash(const game_t *);
+uint64_t game_hash_full(game_t *);
 void    game_free(game_t *);
 
+bool    game_pool_init(game_pool_t *, int capacity);
+void    game_pool_free(game_pool_t *);
+game_t *game_pool_fork(game_pool_t *, const game_t *);
+void    game_pool_release(game_pool_t *, game_t *);
+
 bool    game_build(game_t *, uint16_t building, int x, int y);
+bool    game_can_build(game_t *, uint16_t building, int x, int y);
+bool    game_can_afford(game_t *, yield_t);
 yield_t game_step(game_t *);
 void    game_date(game_t *, char *);
 void    game_draw_units(game_t *game, panel_t *p, bool id);
 
-hero_t  game_hero_generate(void);
+hero_t  game_hero_generate(game_t *game);
+void    game_hero_candidates(game_t *game, hero_t *, int count);
 bool    game_hero_push(game_t *game, hero_t hero);
+bool    game_hero_hire(game_t *game, int slot, hero_t hero);
+bool    game_hero_assign(game_t *game, int hero, int squad);
+bool    game_squad_order(game_t *game, int squad, int target);
 
 enum game_event game_event_pop(game_t *game);
@@ -0,0 +1,437 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "journal.h"
+#include "serial.h"
+#include "device.h"
+#include "rand.h"
+
+/* A journal file is a magic number and version, then records of (op,
+ * game time, arguments), each closed by its own CRC-32. The first
+ * record is always a checkpoint: the game time and checksum of the
+ * state the journal starts from. Replay applies a journal only if the
+ * replayed game reaches exactly that state, so a journal left behind
+ * by an older snapshot is skipped, and a torn or corrupt record ends
+ * the replay. Records are flushed to the operating system as they are
+ * written but only synced to disk at compaction, so a process crash
+ * loses nothing while a power failure can lose the tail since the
+ * last snapshot.
+ *
+ * Background compaction forks a child that writes the snapshot while
+ * the parent records into a second journal, PATH.new, that starts at
+ * the fork. Once the child succeeds, PATH.new is renamed over PATH.
+ * Recovery replays PATH then PATH.new, which is correct at every point
+ * in that sequence.
+ */
+
+#define JOURNAL_MAGIC   "GCOJ"
+#define JOURNAL_VERSION 2
+
+enum journal_op {
+    OP_BUILD = 1, OP_CANDIDATES, OP_HIRE, OP_ASSIGN, OP_ORDER, OP_CHECKPOINT,
+    OP_APOLOGY
+};
+
+static void
+next_path(const char *path, char *buf, size_t size)
+{
+    snprintf(buf, size, "%s.new", path);
+}
+
+/* Replay */
+
+typedef struct record {
+    enum journal_op op;
+    long time;
+    int a, b, c;
+    hero_t hero;
+    uint32_t checksum;
+} record_t;
+
+static bool
+record_read(FILE *in, record_t *r)
+{
+    serial_t s;
+    serial_init(&s, in);
+    r->op = serial_get_uint(&s);
+    r->time = serial_get_int(&s);
+    switch (r->op) {
+    case OP_BUILD:
+        r->a = serial_get_uint(&s);
+        r->b = serial_get_uint(&s);
+        r->c = serial_get_uint(&s);
+        break;
+    case OP_CANDIDATES:
+        r->a = serial_get_uint(&s);
+        if (r->a > HERO_CANDIDATES)
+            serial_fail(&s);
+        break;
+    case OP_HIRE: {
+        hero_t *hero = &r->hero;
+        memset(hero, 0, sizeof(*hero));
+        hero->active = true;
+        r->a = serial_get_uint(&s);
+        size_t len = serial_get_uint(&s);
+        if (len >= sizeof(hero->name))
+            serial_fail(&s);
+        serial_get(&s, hero->name, len);
+        hero->hp = serial_get_int(&s);
+        hero->hp_max = serial_get_int(&s);
+        hero->ap = serial_get_int(&s);
+        hero->ap_max = serial_get_int(&s);
+        hero->str = serial_get_int(&s);
+        hero->dex = serial_get_int(&s);
+        hero->mind = serial_get_int(&s);
+        hero->squad = serial_get_int(&s);
+    } break;
+    case OP_ASSIGN:
+    case OP_ORDER:
+        r->a = serial_get_int(&s);
+        r->b = serial_get_int(&s);
+        break;
+    case OP_CHECKPOINT:
+        r->checksum = serial_get_u32(&s);
+        break;
+    case OP_APOLOGY:
+        break;
+    default:
+        serial_fail(&s);
+    }
+    return serial_get_crc(&s);
+}
+
+/* Run the simulation up to the record's time, then apply it. Returns
+ * false if the record does not fit the replayed game. */
+static bool
+record_apply(game_t *game, record_t *r)
+{
+    if (r->time < game->time)
+        return false;
+    while (game->time < r->time) {
+        game_step(game);
+        while (game_event_pop(game) != EVENT_NONE);
+    }
+    switch (r->op) {
+    case OP_BUILD:
+        return game_build(game, r->a, r->b, r->c);
+    case OP_CANDIDATES: {
+        hero_t candidates[HERO_CANDIDATES];
+        game_hero_candidates(game, candidates, r->a);
+        return true;
+    }
+    case OP_HIRE:
+        return game_hero_hire(game, r->a, r->hero);
+    case OP_ASSIGN:
+        return game_hero_assign(game, r->a, r->b);
+    case OP_ORDER:
+        return game_squad_order(game, r->a, r->b);
+    case OP_CHECKPOINT:
+        return r->checksum == game_checksum(game);
+    case OP_APOLOGY:
+        game->apology_given = true;
+        return true;
+    }
+    return false;
+}
+
+/* Replay one journal file onto GAME. Returns false once the replay has
+ * diverged and no later journal can apply. */
+static bool
+replay_file(game_t *game, const char *path)
+{
+    FILE *in = fopen(path, "rb");
+    if (!in)
+        return true;
+    serial_t s;
+    serial_init(&s, in);
+    char magic[4];
+    serial_get(&s, magic, sizeof(magic));
+    uint64_t version = serial_get_uint(&s);
+    record_t r;
+    bool consistent = true;
+    if (serial_ok(&s) && memcmp(magic, JOURNAL_MAGIC, 4) == 0 &&
+        version == JOURNAL_VERSION && record_read(in, &r) &&
+        r.op == OP_CHECKPOINT && r.time >= game->time) {
+        consistent = record_apply(game, &r);
+        while (consistent && record_read(in, &r))
+            consistent = record_apply(game, &r);
+    }
+    fclose(in);
+    return consistent;
+}
+
+game_t *
+journal_recover(const char *snapshot, const char *path)
+{
+    size_t size;
+    const void *map = device_map(snapshot, &size);
+    if (!map)
+        return NULL;
+    game_t *game = game_load_buffer(map, size);
+    device_unmap(map, size);
+    if (game) {
+        char next[1024];
+        next_path(path, next, sizeof(next));
+        if (replay_file(game, path))
+            replay_file(game, next);
+    }
+    return game;
+}
+
+/* Recording */
+
+void
+journal_close(journal_t *j)
+{
+    if (j->file)
+        fclose(j->file);
+    j->file = NULL;
+}
+
+static bool
+record_begin(journal_t *j, serial_t *s, game_t *game, enum journal_op op)
+{
+    if (!j->file)
+        return false;
+    serial_init(s, j->file);
+    serial_put_uint(s, op);
+    serial_put_int(s, game->time);
+    return true;
+}
+
+static void
+record_end(journal_t *j, serial_t *s)
+{
+    serial_put_crc(s);
+    if (!serial_ok(s) || fflush(j->file) != 0)
+        journal_close(j); // retried at the next compaction
+    else
+        j->records++;
+}
+
+void
+journal_build(journal_t *j, game_t *game, uint16_t building, int x, int y)
+{
+    serial_t s;
+    if (record_begin(j, &s, game, OP_BUILD)) {
+        serial_put_uint(&s, building);
+        serial_put_uint(&s, x);
+        serial_put_uint(&s, y);
+        record_end(j, &s);
+    }
+}
+
+void
+journal_candidates(journal_t *j, game_t *game, int count)
+{
+    serial_t s;
+    if (record_begin(j, &s, game, OP_CANDIDATES)) {
+        serial_put_uint(&s, count);
+        record_end(j, &s);
+    }
+}
+
+void
+journal_hire(journal_t *j, game_t *game, int slot, hero_t hero)
+{
+    serial_t s;
+    if (record_begin(j, &s, game, OP_HIRE)) {
+        size_t len = strlen(hero.name);
+        serial_put_uint(&s, slot);
+        serial_put_uint(&s, len);
+        serial_put(&s, hero.name, len);
+        serial_put_int(&s, hero.hp);
+        serial_put_int(&s, hero.hp_max);
+        serial_put_int(&s, hero.ap);
+        serial_put_int(&s, hero.ap_max);
+        serial_put_int(&s, hero.str);
+        serial_put_int(&s, hero.dex);
+        serial_put_int(&s, hero.mind);
+        serial_put_int(&s, hero.squad);
+        record_end(j, &s);
+    }
+}
+
+void
+journal_assign(journal_t *j, game_t *game, int hero, int squad)
+{
+    serial_t s;
+    if (record_begin(j, &s, game, OP_ASSIGN)) {
+        serial_put_int(&s, hero);
+        serial_put_int(&s, squad);
+        record_end(j, &s);
+    }
+}
+
+void
+journal_order(journal_t *j, game_t *game, int squad, int target)
+{
+    serial_t s;
+    if (record_begin(j, &s, game, OP_ORDER)) {
+        serial_put_int(&s, squad);
+        serial_put_int(&s, target);
+        record_end(j, &s);
+    }
+}
+
+void
+journal_apology(journal_t *j, game_t *game)
+{
+    serial_t s;
+    if (record_begin(j, &s, game, OP_APOLOGY))
+        record_end(j, &s);
+}
+
+static void
+journal_checkpoint(journal_t *j, game_t *game)
+{
+    serial_t s;
+    if (record_begin(j, &s, game, OP_CHECKPOINT)) {
+        serial_put_u32(&s, game_checksum(game));
+        record_end(j, &s);
+    }
+}
+
+/* Start an empty journal at PATH for the current state of GAME. */
+static bool
+journal_start(journal_t *j, const char *path, game_t *game)
+{
+    journal_close(j);
+    j->records = 0;
+    j->base_time = game->time;
+    j->last_checkpoint = device_uepoch();
+    if (!(j->file = fopen(path, "wb")))
+        return false;
+    serial_t s;
+    serial_init(&s, j->file);
+    serial_put(&s, JOURNAL_MAGIC, 4);
+    serial_put_uint(&s, JOURNAL_VERSION);
+    if (!serial_ok(&s))
+        journal_close(j);
+    else
+        journal_checkpoint(j, game);
+    return j->file != NULL;
+}
+
+/* Compaction */
+
+/* Write a snapshot next to PATH, sync it and rename it over PATH. The
+ * old snapshot survives a crash at any point. */
+static bool
+snapshot_write(const char *path, game_t *game)
+{
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *out = fopen(tmp, "wb");
+    if (!out)
+        return false;
+    bool success = game_save(game, out) && device_sync(out);
+    success &= fclose(out) == 0;
+    if (success && device_replace(tmp, path))
+        return true;
+    unlink(tmp);
+    return false;
+}
+
+/* Settle a background compaction, waiting for it with BLOCK. Returns
+ * true if it succeeded. */
+static bool
+journal_reap(journal_t *j, bool block)
+{
+    int status = device_wait(j->child, block);
+    if (status < 0)
+        return false;
+    j->child = 0;
+    char next[1024];
+    next_path(j->path, next, sizeof(next));
+    if (status && device_replace(next, j->path)) {
+        j->saved = device_uepoch();
+        return true;
+    }
+    return false;
+}
+
+bool
+journal_compact(journal_t *j, game_t *game)
+{
+    if (j->child)
+        journal_reap(j, true);
+    journal_close(j);
+    if (!snapshot_write(j->snapshot, game))
+        return false;
+    /* Crashing from here on leaves journals that start before the new
+     * snapshot, which replay skips. */
+    char next[1024];
+    next_path(j->path, next, sizeof(next));
+    unlink(next);
+    if (!journal_start(j, j->path, game))
+        return false;
+    j->saved = device_uepoch();
+    return true;
+}
+
+/* Snapshot in a forked child while this process keeps recording into
+ * the next journal. Falls back to compacting in the foreground. */
+static void
+journal_compact_background(journal_t *j, game_t *game)
+{
+    int pid = device_fork();
+    if (pid == 0) {
+        device_exit(snapshot_write(j->snapshot, game));
+    } else if (pid < 0) {
+        journal_compact(j, game);
+    } else {
+        char next[1024];
+        next_path(j->path, next, sizeof(next));
+        j->child = pid;
+        journal_start(j, next, game);
+    }
+}
+
+bool
+journal_init(journal_t *j, const char *snapshot, const char *path,
+             game_t *game)
+{
+    j->file = NULL;
+    j->snapshot = snapshot;
+    j->path = path;
+    j->child = 0;
+    j->saved = 0;
+    return journal_compact(j, game);
+}
+
+/* Called once per frame: checkpoint or compact when due. A compaction
+ * still running from last time is polled, never waited on. */
+void
+journal_autosave(journal_t *j, game_t *game)
+{
+    uint64_t now = device_uepoch();
+    if (j->child) {
+        int child = j->child;
+        if (!journal_reap(j, false) && child != j->child)
+            journal_compact(j, game); // child failed, retry in foreground
+    } else if (!j->file || j->records >= JOURNAL_MAX_RECORDS ||
+               game->time - j->base_time >= JOURNAL_SPAN) {
+        journal_compact_background(j, game);
+        return;
+    }
+    if (j->file && now - j->last_checkpoint >= JOURNAL_CHECKPOINT) {
+        journal_checkpoint(j, game);
+        j->last_checkpoint = now;
+    }
+}
+
+/* Forget the game entirely, e.g. once it has been won or lost. */
+void
+journal_remove(journal_t *j)
+{
+    if (j->child)
+        device_wait(j->child, true);
+    j->child = 0;
+    journal_close(j);
+    char next[1024];
+    next_path(j->path, next, sizeof(next));
+    unlink(next);
+    unlink(j->path);
+    unlink(j->snapshot);
+}
@@ -0,0 +1,43 @@
+/**
+ * Crash-safe autosave. Player commands and periodic checkpoints are
+ * appended to a journal as they happen; every so often the game is
+ * compacted into a fresh snapshot (written to a temporary file, synced
+ * and renamed into place) and the journal restarts empty. Recovery
+ * loads the snapshot and replays the journal on top of it, relying on
+ * the simulation being deterministic between commands. Where the
+ * platform allows, compaction runs in a forked child so that the frame
+ * never waits on the disk.
+ */
+#pragma once
+
+#include "game.h"
+
+#define JOURNAL_SPAN        DAY     // game time between compactions
+#define JOURNAL_MAX_RECORDS 4096    // records between compactions
+#define JOURNAL_CHECKPOINT  1000000 // usec of real time between checkpoints
+
+typedef struct journal {
+    FILE *file;
+    const char *snapshot;
+    const char *path;
+    long base_time; // game time of the snapshot
+    long records;
+    uint64_t last_checkpoint;
+    int child;      // process writing a snapshot, or 0
+    uint64_t saved; // device_uepoch() of the last completed snapshot
+} journal_t;
+
+game_t *journal_recover(const char *snapshot, const char *path);
+bool    journal_init(journal_t *, const char *snapshot, const char *path,
+                     game_t *);
+bool    journal_compact(journal_t *, game_t *);
+void    journal_autosave(journal_t *, game_t *);
+void    journal_close(journal_t *);
+void    journal_remove(journal_t *);
+
+void    journal_build(journal_t *, game_t *, uint16_t building, int x, int y);
+void    journal_candidates(journal_t *, game_t *, int count);
+void    journal_hire(journal_t *, game_t *, int slot, hero_t);
+void    journal_assign(journal_t *, game_t *, int hero, int squad);
+void    journal_order(journal_t *, game_t *, int squad, int target);
+void    journal_apology(journal_t *, game_t *);
@@ -10,36 +10,183 @@
 #include "rand.h"
 #include "map.h"
 #include "game.h"
+#include "advisor.h"
+#include "journal.h"
+#include "slots.h"
+#include "replay.h"
+#include "timeline.h"
 #include "utf.h"
+#include "vterm.h"
 
 #define FPS 15
 #define PERIOD (1000000 / FPS)
 #define SPEED_MAX 7776
 #define SPEED_FACTOR 6
-#define PERSIST_FILE "persist.gcom"
+#define AUTOSAVE_NOTICE 2000000 // usec the autosave notice stays up
 
 static const font_t font_error = FONT_STATIC(Y, k);
 
+/* The side menu is retained: its frame and menu entries are drawn
+ * once, and each field only when its text changes. */
+enum sidemenu_field {
+    FIELD_GOLD, FIELD_FOOD, FIELD_WOOD, FIELD_POPULATION,
+    FIELD_DATE, FIELD_SPEED, FIELD_NOTICE, FIELD_COUNT
+};
+
+typedef struct sidemenu {
+    panel_t panel;
+    bool drawn;                  // the frame and menu entries are up
+    char text[FIELD_COUNT][64];  // markup each field was last drawn from
+} sidemenu_t;
+
+/* How often the session may draw, given how fast the terminal drains
+ * output. On a link too slow for the full frame rate, frames are drawn
+ * less often and the coast stops animating, while the game keeps its
+ * pace. Nothing is lost by skipping a frame: panels hold their changes
+ * until the next refresh, which sends them merged. */
+#define BUDGET_SHARE 70           // percent of the link frames may use
+#define BUDGET_PERIOD_MAX 1000000 // usec, the slowest frame rate
+#define BUDGET_CALM 5000000       // usec of room to spare before animating
+
+typedef struct budget {
+    uint64_t period; // usec between frames, at least PERIOD
+    bool animate;    // the coast animation is affordable
+    uint64_t last;   // device_clock() when a frame was last drawn
+    uint64_t tight;  // device_clock() when the link was last too slow
+} budget_t;
+
+/* Everything one interactive game needs: its render target, the game
+ * itself and the panels the main loop keeps on the display stack. */
+typedef struct session {
+    device_t *device;
+    display_t display;
+    game_t *game;
+    journal_t journal;
+    char slot[SLOT_NAME_MAX];
+    char snapshot_path[SLOT_PATH_MAX];
+    char journal_path[SLOT_PATH_MAX];
+    uint64_t indexed; // journal.saved when the index was last updated
+    replay_t replay;
+    timeline_t timeline;
+    sidemenu_t sidemenu;
+    panel_t terrain;
+    terrain_t terrain_cache;
+    budget_t budget;
+    panel_t buildings;
+    panel_t units;
+    bool save_on_exit;
+    bool interrupted;
+} session_t;
+
+static void
+budget_init(budget_t *b)
+{
+    b->period = PERIOD;
+    b->animate = true;
+    b->last = 0;
+    b->tight = 0;
+}
+
+/* Refit B to the link and decide whether a frame is due at NOW. At
+ * the full rate every frame is, since the main loop already paces
+ * them. A frame also waits while the terminal has more than a period's
+ * output, or a couple of frames, still to show, which bounds the lag. */
+static bool
+budget_due(budget_t *b, device_link_t link, uint64_t now)
+{
+    uint64_t cost = 0; // usec of our share of the link per frame
+    if (link.rate)
+        cost = (uint64_t)link.frame * 100000000 / BUDGET_SHARE / link.rate;
+    b->period = cost < PERIOD ? PERIOD : cost;
+    if (b->period > BUDGET_PERIOD_MAX)
+        b->period = BUDGET_PERIOD_MAX;
+    /* The surf adds to every frame, so it stops as soon as the full
+     * rate is out of reach and only resumes after a spell with room
+     * to spare. */
+    if (cost * 2 > PERIOD)
+        b->tight = now;
+    if (cost > PERIOD)
+        b->animate = false;
+    else if (now - b->tight >= BUDGET_CALM)
+        b->animate = true;
+    uint64_t allow = 2 * link.frame;
+    if (link.rate * b->period / 1000000 > allow)
+        allow = link.rate * b->period / 1000000;
+    bool early = now - b->last + PERIOD / 2 < b->period;
+    if (link.backlog > allow || (b->period > PERIOD && early))
+        return false;
+    b->last = now;
+    return true;
+}
+
 static bool
 is_exit_key(int key)
 {
-    return key == 'Q' || key == 'q' || key == 27;
+    return key == 'Q' || key == 'q' || key == 27 || key == KEY_INTERRUPT;
 }
 
+/* Every key the session reads goes through here, so that it can be
+ * recorded or played back. */
 static int
-game_getch(game_t *game, panel_t *terrain)
+session_getch(session_t *s)
 {
-    for (;;) {
-        map_draw_terrain(game->map, terrain);
-        display_refresh();
-        uint64_t wait = device_uepoch() % PERIOD;
-        if (device_kbhit(wait))
-            return device_getch();
+    if (s->interrupted)
+        return KEY_INTERRUPT;
+    int key;
+    if (s->replay.playing)
+        key = replay_getch(&s->replay, s->game);
+    else
+        key = device_getch(s->device);
+    replay_key(&s->replay, s->game, key);
+    if (key == KEY_INTERRUPT)
+        s->interrupted = true;
+    return key;
+}
+
+/* Wait for a key until device_clock() reaches DEADLINE. */
+static bool
+session_kbhit(session_t *s, uint64_t deadline)
+{
+    if (s->replay.playing)
+        return replay_pending(&s->replay, s->game);
+    return device_kbhit_until(s->device, deadline);
+}
+
+/* Whether the output budget allows a frame now. */
+static bool
+session_due(session_t *s)
+{
+    bool due = budget_due(&s->budget, device_link(s->device), device_clock());
+    s->terrain_cache.still = !s->budget.animate;
+    return due;
+}
+
+static int
+game_getch(session_t *s)
+{
+    if (s->replay.playing)
+        return session_getch(s); // the game is paused, so it is due now
+    /* The game stands still, so wake up only for the surf. */
+    uint64_t last = device_clock();
+    while (!s->interrupted) {
+        bool drawn = session_due(s);
+        if (drawn) {
+            map_draw_terrain(&s->terrain_cache, &s->game->map,
+                             s->game->map_seed);
+            display_refresh(&s->display);
+        }
+        uint64_t due = map_terrain_due(&s->terrain_cache);
+        if (!drawn || (due != DEVICE_FOREVER && due < last + s->budget.period))
+            due = last + s->budget.period; // no faster than the budget
+        if (device_kbhit_until(s->device, due))
+            return session_getch(s);
+        last = device_clock();
     }
+    return KEY_INTERRUPT;
 }
 
 static void
-popup_message(font_t font, char *format, ...)
+popup_message(session_t *s, font_t font, char *format, ...)
 {
     va_list ap;
     va_start(ap, format);
@@ -50,22 +197,26 @@ popup_message(font_t font, char *format, ...)
     vsprintf(buffer, format, ap);
     va_end(ap);
     int width = length + 2;
+    if (width > DISPLAY_WIDTH)
+        width = DISPLAY_WIDTH; // the panel cuts the text short
     int height = 3;
     panel_t popup;
-    panel_center_init(&popup, width, height);
+    panel_center_init(&popup, &s->display, width, height);
     panel_puts(&popup, 1, 1, font, buffer);
-    display_push(&popup);
+    panel_putc(&popup, width - 1, 1, font, ' ');
+    display_push(&s->display, &popup);
     for (;;) {
-        int key = display_getch();
+        display_refresh(&s->display);
+        int key = session_getch(s);
         if (is_exit_key(key) || key == 13 || key == ' ')
             break;
     }
-    display_pop_free();
-    display_refresh();
+    display_pop_free(&s->display);
+    display_refresh(&s->display);
 }
 
 static bool
-popup_quit(bool saving)
+popup_quit(session_t *s, bool saving)
 {
     panel_t popup;
     char *message;
@@ -74,26 +225,27 @@ popup_quit(bool saving)
     else
         message = "Really quit Yk{without saving}? (Rk{y}/Rk{n})";
     size_t length = strlen(message) - 8;
-    panel_center_init(&popup, length + 2, 3);
+    panel_center_init(&popup, &s->display, length + 2, 3);
     panel_printf(&popup, 1, 1, message);
-    display_push(&popup);
-    display_refresh();
-    int input = device_getch();
-    display_pop_free();
-    display_refresh();
+    display_push(&s->display, &popup);
+    display_refresh(&s->display);
+    int input = session_getch(s);
+    display_pop_free(&s->display);
+    display_refresh(&s->display);
     if (input == 'y' || input == 'Y')
         return true;
     return false;
 }
 
 #define SIDEMENU_WIDTH (DISPLAY_WIDTH - MAP_WIDTH)
+#define ADVISOR_SHOW 5
 
 static int
-sideinfo(panel_t *p, char *message)
+sideinfo(session_t *s, panel_t *p, char *message)
 {
-    panel_init(p, DISPLAY_WIDTH - SIDEMENU_WIDTH, 0,
+    panel_init(p, &s->display, DISPLAY_WIDTH - SIDEMENU_WIDTH, 0,
                SIDEMENU_WIDTH, DISPLAY_HEIGHT);
-    display_push(p);
+    display_push(&s->display, p);
     panel_fill(p, FONT(K, k), 0x2591);
     panel_border(p, FONT(K, k));
     int y = DISPLAY_HEIGHT / 2 - 1;
@@ -102,42 +254,80 @@ sideinfo(panel_t *p, char *message)
     return y;
 }
 
+static const int sidemenu_field_y[FIELD_COUNT] = {3, 4, 5, 6, 20, 21, 22};
+
+static bool
+sidemenu_init(sidemenu_t *m, display_t *d)
+{
+    m->drawn = false;
+    return panel_init(&m->panel, d, DISPLAY_WIDTH - SIDEMENU_WIDTH, 0,
+                      SIDEMENU_WIDTH, DISPLAY_HEIGHT);
+}
+
+/* Set FIELD to the formatted markup, touching the panel only if the
+ * text differs from what the field already shows. */
+static void
+sidemenu_set(sidemenu_t *m, enum sidemenu_field field, const char *format, ...)
+    __attribute__ ((format (printf, 3, 4)));
+
+static void
+sidemenu_set(sidemenu_t *m, enum sidemenu_field field, const char *format, ...)
+{
+    char text[sizeof(m->text[field])];
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(text, sizeof(text), format, ap);
+    va_end(ap);
+    if (strcmp(text, m->text[field]) == 0)
+        return;
+    strcpy(m->text[field], text);
+    panel_t *p = &m->panel;
+    int y = sidemenu_field_y[field];
+    panel_printf(p, 2, y, "%s", text);
+    for (int x = 2 + panel_strlen(text); x < p->w - 1; x++)
+        panel_putc(p, x, y, FONT(w, k), ' '); // the rest of a longer value
+}
+
 static void
-sidemenu_draw(panel_t *p, game_t *game, yield_t diff)
+sidemenu_draw(sidemenu_t *m, game_t *game, yield_t diff)
 {
-    font_t font_title = FONT(w, k);
-    panel_fill(p, font_title, ' ');
-    panel_border(p, font_title);
-    panel_puts(p, 5, 1, font_title, "Goblin-COM");
+    panel_t *p = &m->panel;
+    if (!m->drawn) {
+        font_t font_title = FONT(w, k);
+        panel_fill(p, font_title, ' ');
+        panel_border(p, font_title);
+        panel_puts(p, 5, 1, font_title, "Goblin-COM");
+
+        int x = 2;
+        int y = 8;
+        panel_printf(p, x, y++, "Kk{♦}    wk{Rk{B}uild}     Kk{♦}");
+        panel_printf(p, x, y++, "Kk{♦}    wk{Rk{H}eroes}    Kk{♦}");
+        panel_printf(p, x, y++, "Kk{♦}    wk{Rk{S}quads}    Kk{♦}");
+        panel_printf(p, x, y++, "Kk{♦}    wk{ReRk{w}ind}    Kk{♦}");
 
-    font_t font_totals = FONT(W, k);
-    int ty = 3;
-    panel_printf(p, 2, ty++, "Gold: Yk{%ld}wk{%+d}",
+        y = 17;
+        panel_printf(p, x, y++, "Kk{♦}    wk{SRk{t}ory}     Kk{♦}");
+        panel_printf(p, x, y++, "Kk{♦}     wk{HelRk{p}}     Kk{♦}");
+        memset(m->text, 0, sizeof(m->text)); // every field is blank
+        m->drawn = true;
+    }
+
+    sidemenu_set(m, FIELD_GOLD, "Gold: Yk{%ld}wk{%+d}",
                  (long)game->gold, (int)diff.gold);
-    panel_printf(p, 2, ty++, "Food: Yk{%ld}wk{%+d}",
+    sidemenu_set(m, FIELD_FOOD, "Food: Yk{%ld}wk{%+d}",
                  (long)game->food, (int)diff.food);
-    panel_printf(p, 2, ty++, "Wood: Yk{%ld}wk{%+d}",
+    sidemenu_set(m, FIELD_WOOD, "Wood: Yk{%ld}wk{%+d}",
                  (long)game->wood, (int)diff.wood);
-    panel_printf(p, 2, ty++, "Pop.: %ld", (long)game->population);
-
-    int x = 2;
-    int y = 8;
-    panel_printf(p, x, y++, "Kk{♦}    wk{Rk{B}uild}     Kk{♦}");
-    panel_printf(p, x, y++, "Kk{♦}    wk{Rk{H}eroes}    Kk{♦}");
-    panel_printf(p, x, y++, "Kk{♦}    wk{Rk{S}quads}    Kk{♦}");
-
-    y = 17;
-    panel_printf(p, x, y++, "Kk{♦}    wk{SRk{t}ory}     Kk{♦}");
-    panel_printf(p, x, y++, "Kk{♦}     wk{HelRk{p}}     Kk{♦}");
+    sidemenu_set(m, FIELD_POPULATION, "Pop.: %ld", (long)game->population);
 
     char date[128];
     game_date(game, date);
-    panel_puts(p, 2, 20, font_totals, date);
+    sidemenu_set(m, FIELD_DATE, "Wk{%s}", date);
 
-    font_t base = FONT(w, k);
-    panel_puts(p, 2, 21, base, "Speed: ");
-    for (int x = 0, i = 1; i <= game->speed; i *= SPEED_FACTOR, x++)
-        panel_puts(p, 9 + x, 21, font_totals, ">");
+    char speed[16] = "";
+    for (int x = 0, i = 1; i <= game->speed && x < 15; i *= SPEED_FACTOR, x++)
+        speed[x] = '>';
+    sidemenu_set(m, FIELD_SPEED, "wk{Speed: }Wk{%s}", speed);
 }
 
 /* Sloppy, but it works! */
@@ -151,13 +341,13 @@ u8encode(uint16_t c)
 }
 
 static uint16_t
-popup_build_select(game_t *game, panel_t *terrain)
+popup_build_select(session_t *s)
 {
     int width = 56;
     int height = 20;
     panel_t build;
-    panel_center_init(&build, width, height);
-    display_push(&build);
+    panel_center_init(&build, &s->display, width, height);
+    display_push(&s->display, &build);
     panel_border(&build, FONT(w, k));
 
     int input;
@@ -214,12 +404,12 @@ popup_build_select(game_t *game, panel_t *terrain)
                  "gk{removes movement penalties}", yield);
     panel_printf(p, 5, y++, "wk{Target: (any land)}");
 
-    while (result == 0 && !is_exit_key(input = game_getch(game, terrain)))
+    while (result == 0 && !is_exit_key(input = game_getch(s)))
         if (strchr("wfshmr", input))
             result = toupper(input);
     if (result == 'R')
         result = '+';
-    display_pop_free();
+    display_pop_free(&s->display);
     return result;
 }
 
@@ -259,77 +449,94 @@ arrow_adjust(int input, int *x, int *y)
     return false;
 }
 
+static void
+advise(session_t *s, uint16_t building, panel_t *info, int sidey,
+       panel_t *marks, int *x, int *y)
+{
+    if (s->replay.playing) {
+        replay_get_cursor(&s->replay, s->game, x, y);
+        return;
+    }
+    panel_printf(info, 5, sidey + 4, "Yk{Thinking ...}");
+    display_refresh(&s->display);
+    advice_t advice[ADVISOR_SHOW];
+    int count = advisor_rank(s->game, building, advice, countof(advice),
+                             ADVISOR_BUDGET, 0);
+    panel_clear(marks);
+    for (int i = 0; i < ADVISOR_SHOW; i++) {
+        int ty = sidey + 4 + i;
+        for (int tx = 1; tx < info->w - 1; tx++)
+            panel_putc(info, tx, ty, FONT(K, k), 0x2591);
+        if (i < count) {
+            panel_putc(marks, advice[i].x, advice[i].y, FONT(k, Y), '1' + i);
+            panel_printf(info, 2, ty, "Rk{%d} %3.0f%% safe",
+                         i + 1, advice[i].survival * 100);
+        } else if (i == 0) {
+            panel_printf(info, 2, ty, "Kk{No placements}");
+        }
+    }
+    if (count > 0) {
+        *x = advice[0].x;
+        *y = advice[0].y;
+    }
+    replay_cursor(&s->replay, s->game, *x, *y); // budgeted, so not repeatable
+}
+
 static bool
-select_position(game_t *game, panel_t *world, int *x, int *y)
+select_position(session_t *s, uint16_t building, int *x, int *y)
 {
+    panel_t *world = &s->terrain;
     panel_t info;
-    int sidey = sideinfo(&info, "Yk{Select Location}");
+    int sidey = sideinfo(s, &info, "Yk{Select Location}");
     panel_printf(&info, 6, sidey + 1, "Use Rk{←↑→↓}");
+    panel_printf(&info, 7, sidey + 2, "Rk{a}dvise");
 
     font_t highlight = FONT(W, r);
     bool selected = false;
+    panel_t marks;
+    panel_init(&marks, &s->display, 0, 0, MAP_WIDTH, MAP_HEIGHT);
+    display_push(&s->display, &marks);
     panel_t overlay;
-    panel_init(&overlay, 0, 0, MAP_WIDTH, MAP_HEIGHT);
+    panel_init(&overlay, &s->display, 0, 0, MAP_WIDTH, MAP_HEIGHT);
     panel_putc(&overlay, *x, *y, highlight, panel_getc(world, *x, *y));
-    display_push(&overlay);
+    display_push(&s->display, &overlay);
     int input;
-    while (!selected && !is_exit_key(input = game_getch(game, world))) {
+    while (!selected && !is_exit_key(input = game_getch(s))) {
         panel_erase(&overlay, *x, *y);
         arrow_adjust(input, x, y);
+        if (input == 'a')
+            advise(s, building, &info, sidey, &marks, x, y);
         panel_putc(&overlay, *x, *y, highlight, panel_getc(world, *x, *y));
         if (input == 13)
             selected = true;
     }
 
-    display_pop_free(); // overlay
-    display_pop_free(); // info
+    display_pop_free(&s->display); // overlay
+    display_pop_free(&s->display); // marks
+    display_pop_free(&s->display); // info
     return selected;
 }
 
-static bool
-can_afford(game_t *game, yield_t yield)
-{
-    return
-        (yield.food == 0 || game->food >= yield.food) &&
-        (yield.wood == 0 || game->wood >= yield.wood) &&
-        (yield.gold == 0 || game->gold >= yield.gold);
-}
-
-static bool
-persist(game_t *game)
-{
-    FILE *save = fopen(PERSIST_FILE, "wb");
-    if (save) {
-        game_save(game, save);
-        return fclose(save) == 0;
-    }
-    return false;
-}
-
-static game_t *atexit_save_game;
-static void
-atexit_save(void)
-{
-    if (atexit_save_game)
-        persist(atexit_save_game);
-}
-
 static void
-ui_build(game_t *game, panel_t *terrain)
+ui_build(session_t *s)
 {
+    game_t *game = s->game;
     uint16_t building;
-    while ((building = popup_build_select(game, terrain))) {
+    while ((building = popup_build_select(s))) {
         yield_t cost = building_cost(building);
-        if (!can_afford(game, cost)) {
-            popup_message(font_error, "Not enough funding/materials!");
+        if (!game_can_afford(game, cost)) {
+            popup_message(s, font_error, "Not enough funding/materials!");
         } else {
             int x = MAP_WIDTH / 2;
             int y = MAP_HEIGHT / 2;
-            while (select_position(game, terrain, &x, &y)) {
-                if (!game_build(game, building, x, y))
-                    popup_message(font_error, "Invalid building location!");
-                else
+            while (select_position(s, building, &x, &y)) {
+                if (!game_build(game, building, x, y)) {
+                    popup_message(s, font_error,
+                                  "Invalid building location!");
+                } else {
+                    journal_build(&s->journal, game, building, x, y);
                     break;
+                }
             }
             break;
         }
@@ -338,10 +545,11 @@ ui_build(game_t *game, panel_t *terrain)
 }
 
 static int
-select_target(game_t *game, panel_t *terrain, panel_t *units)
+select_target(session_t *s)
 {
+    game_t *game = s->game;
     panel_t info;
-    sideinfo(&info, "Yk{Select Target}");
+    sideinfo(s, &info, "Yk{Select Target}");
 
     int key = 0;
     int result = -1;
@@ -350,85 +558,93 @@ select_target(game_t *game, panel_t *terrain, panel_t *units)
             result = key - 'a';
             break;
         }
-        game_draw_units(game, units, true);
-    } while (!is_exit_key(key = game_getch(game, terrain)));
+        game_draw_units(game, &s->units, true);
+    } while (!is_exit_key(key = game_getch(s)));
 
-    display_pop_free();
+    display_pop_free(&s->display);
     return result;
 }
 
 static void
-ui_squads(game_t *game, panel_t *terrain, panel_t *units)
+ui_squads(session_t *s)
 {
+    game_t *game = s->game;
     panel_t p;
-    panel_center_init(&p, 29, countof(game->squads) + 3);
+    panel_center_init(&p, &s->display, 29, countof(game->squads) + 3);
     panel_border(&p, FONT(w, k));
     panel_printf(&p, 1, 1, "wk{Squad Size Status}");
-    display_push(&p);
+    display_push(&s->display, &p);
     int key = 0;
     do {
         if (key >= 'a' && key < 'a' + (int)countof(game->squads)) {
-            display_pop();
-            int target = select_target(game, terrain, units);;
-            game->squads[key - 'a'].target = target;
-            display_push(&p);
+            display_pop(&s->display);
+            int target = select_target(s);
+            if (game_squad_order(game, key - 'a', target))
+                journal_order(&s->journal, game, key - 'a', target);
+            display_push(&s->display, &p);
             break;
         }
         for (unsigned i = 0; i < countof(game->squads); i++) {
-            squad_t *s = game->squads + i;
+            squad_t *squad = game->squads + i;
             char status[32];
-            if (s->member_count == 0)
+            if (squad->member_count == 0)
                 sprintf(status, "Kk{Empty}");
-            else if (s->target < 0)
+            else if (squad->target < 0)
                 sprintf(status, "Ck{Idle/Waiting}");
             else
-                sprintf(status, "Rk{Intercepting %c}", s->target + 'A');
+                sprintf(status, "Rk{Intercepting %c}", squad->target + 'A');
             panel_printf(&p, 1, i + 2, "Yk{%-5c} %-4u %-16s",
-                         i + 'A', s->member_count, status);
+                         i + 'A', squad->member_count, status);
         }
-    } while (!is_exit_key(key = game_getch(game, terrain)));
-    display_pop_free();
+    } while (!is_exit_key(key = game_getch(s)));
+    display_pop_free(&s->display);
 }
 
 static void
-ui_hire(game_t *game, panel_t *terrain, int slot)
+ui_hire(session_t *s, int slot)
 {
+    game_t *game = s->game;
     int w = 46;
     int h = 14;
     panel_t listing;
-    panel_center_init(&listing, w, h);
-    display_push(&listing);
+    panel_center_init(&listing, &s->display, w, h);
+    display_push(&s->display, &listing);
     panel_fill(&listing, FONT_DEFAULT, ' ');
     panel_border(&listing, FONT(Y, k));
     panel_printf(&listing, w / 2 - 7, 1, "yk{Hire New Hero}");
     panel_printf(&listing, 1, 2,
                  "wk{  Name               HP   AP  STR  DEX MIND}");
     hero_t candidates[HERO_CANDIDATES];
+    game_hero_candidates(game, candidates, countof(candidates));
+    journal_candidates(&s->journal, game, countof(candidates));
     for (unsigned i = 0; i < countof(candidates); i++) {
-        hero_t h = candidates[i] = game_hero_generate();
+        hero_t h = candidates[i];
         panel_printf(&listing, 1, i + 3,
                      "Rk{%c} Ck{%-16s} %4d %4d %4d %4d %4d",
                      'A' + i, h.name,
                      h.hp_max, h.ap_max, h.str, h.dex, h.mind);
     }
     int key = 0;
-    while (!is_exit_key(key = game_getch(game, terrain))) {
+    while (!is_exit_key(key = game_getch(s))) {
         if (key >= 'a' && key < 'a' + (int)countof(candidates)) {
-            game->heroes[slot] = candidates[key - 'a'];
+            hero_t hero = candidates[key - 'a'];
+            if (game_hero_hire(game, slot, hero))
+                journal_hire(&s->journal, game, slot, hero);
             break;
         }
     }
-    display_pop_free();
+    display_pop_free(&s->display);
 }
 
 static void
-ui_heroes(game_t *game, panel_t *terrain)
+ui_heroes(session_t *s)
 {
+    game_t *game = s->game;
     panel_t p;
     int w = 50;
     int h = 22;
-    panel_center_init(&p, w, h);
-    display_push(&p);
+    panel_center_init(&p, &s->display, w, h);
+    display_push(&s->display, &p);
 
     int per_page = h - 3;
     int total = countof(game->heroes);
@@ -466,21 +682,14 @@ ui_heroes(game_t *game, panel_t *terrain)
         case '=':
         case '-': {
             hero_t *h = game->heroes + selection;
-            if (h->active) {
-                int new_squad = h->squad + (key == '-' ? -1 : 1);
-                if (new_squad >= -1 && new_squad < (int)countof(game->squads)) {
-                    if (h->squad >= 0)
-                        game->squads[h->squad].member_count--;
-                    h->squad = new_squad;
-                    if (h->squad >= 0)
-                        game->squads[h->squad].member_count++;
-                }
-            }
+            int squad = h->squad + (key == '-' ? -1 : 1);
+            if (h->active && game_hero_assign(game, selection, squad))
+                journal_assign(&s->journal, game, selection, squad);
         } break;
         case 13: {
             hero_t *h = game->heroes + selection;
             if (!h->active && selection < game->max_hero)
-                ui_hire(game, terrain, selection);
+                ui_hire(s, selection);
         }break;
         }
         panel_printf(&p, 1, h - 1, "Rk{<} wk{Page %d} Rk{>}", page + 1);
@@ -511,8 +720,8 @@ ui_heroes(game_t *game, panel_t *terrain)
                          h->hp_max, h->ap_max,
                          h->str, h->dex, h->mind);
         }
-    } while (!is_exit_key(key = game_getch(game, terrain)));
-    display_pop_free();
+    } while (!is_exit_key(key = game_getch(s)));
+    display_pop_free(&s->display);
 }
 
 static inline const char *
@@ -549,11 +758,11 @@ text_linelen(const char *p)
 }
 
 static void
-text_page(game_t *game, panel_t *terrain, const char *p, int w, int h)
+text_page(session_t *s, const char *p, int w, int h)
 {
     panel_t page;
-    panel_center_init(&page, w + 4, h + 2);
-    display_push(&page);
+    panel_center_init(&page, &s->display, w + 4, h + 2);
+    display_push(&s->display, &page);
     font_t border = FONT(K, k);
     int numlines = text_numlines(p);
     int topline = 0;
@@ -595,170 +804,406 @@ text_page(game_t *game, panel_t *terrain, const char *p, int w, int h)
             panel_printf(&page, 2, y + 1, copy);
             line = text_next_line(line);
         }
-    } while (!is_exit_key(key = game_getch(game, terrain)));
+    } while (!is_exit_key(key = game_getch(s)));
 
-    display_pop_free();
+    display_pop_free(&s->display);
 }
 
 static void
-ui_story(game_t *game, panel_t *terrain)
+ui_story(session_t *s)
 {
     extern const char _binary_doc_story_txt_start[];
-    text_page(game, terrain, _binary_doc_story_txt_start, 60, 20);
+    text_page(s, _binary_doc_story_txt_start, 60, 20);
 }
 
 static void
-ui_help(game_t *game, panel_t *terrain)
+ui_help(session_t *s)
 {
     extern const char _binary_doc_help_txt_start[];
-    text_page(game, terrain, _binary_doc_help_txt_start, 60, 19);
+    text_page(s, _binary_doc_help_txt_start, 60, 19);
 }
 
 static void
-ui_gameover(game_t *game, panel_t *terrain)
+ui_gameover(session_t *s)
 {
     extern const char _binary_doc_game_over_txt_start[];
-    text_page(game, terrain, _binary_doc_game_over_txt_start, 60, 16);
+    text_page(s, _binary_doc_game_over_txt_start, 60, 16);
 }
 
 static void
-ui_halfway(game_t *game, panel_t *terrain)
+ui_halfway(session_t *s)
 {
     extern const char _binary_doc_halfway_txt_start[];
-    text_page(game, terrain, _binary_doc_halfway_txt_start, 60, 16);
+    text_page(s, _binary_doc_halfway_txt_start, 60, 16);
 }
 
 static void
-ui_win(game_t *game, panel_t *terrain)
+ui_win(session_t *s)
 {
     extern const char _binary_doc_win_txt_start[];
-    text_page(game, terrain, _binary_doc_win_txt_start, 60, 16);
+    text_page(s, _binary_doc_win_txt_start, 60, 16);
 }
 
 static void
-ui_apology(game_t *game, panel_t *terrain)
+ui_apology(session_t *s)
 {
     extern const char _binary_doc_apology_txt_start[];
-    if (!game->apology_given)
-        text_page(game, terrain, _binary_doc_apology_txt_start, 60, 14);
-    game->apology_given = true;
+    if (!s->game->apology_given) {
+        text_page(s, _binary_doc_apology_txt_start, 60, 14);
+        s->game->apology_given = true;
+        journal_apology(&s->journal, s->game);
+        timeline_mark(&s->timeline, s->game);
+    }
 }
 
-int
-main(void)
+/* Scrub back through the timeline, previewing on the map, and branch
+ * the game from the chosen moment. */
+static void
+ui_rewind(session_t *s)
 {
-    int w, h;
-    display_init();
-    device_terminal_size(&w, &h);
-    if (w < DISPLAY_WIDTH || h < DISPLAY_HEIGHT) {
-        display_free();
-        printf("Goblin-COM requires a terminal of at least %dx%d characters!\n"
-               "I see %dx%d\n"
-               "Press enter to exit ...\n",
-               DISPLAY_WIDTH, DISPLAY_HEIGHT, w, h);
-        fflush(stdout);
-        getchar();
-        exit(EXIT_FAILURE);
+    game_t *game = s->game;
+    long start = timeline_start(&s->timeline);
+    game_t *preview = game_clone(game);
+    if (start < 0 || !preview) {
+        game_free(preview);
+        return;
     }
-    device_entropy(&rand_state, sizeof(rand_state));
-    device_title("Goblin-COM");
+    panel_t info;
+    int sidey = sideinfo(s, &info, "Yk{Rewind}");
+    panel_printf(&info, 3, sidey + 1, "Rk{←→} hour  Rk{↑↓} day");
+    panel_printf(&info, 4, sidey + 2, "Rk{enter} to branch");
 
-    panel_t loading;
-    uint8_t loading_message[] = "Initializing world ...";
-    panel_center_init(&loading, sizeof(loading_message), 1);
-    display_push(&loading);
-    panel_puts(&loading, 0, 0, FONT_DEFAULT, (char *)loading_message);
-    display_refresh();
-    game_t *game;
-    FILE *save = fopen(PERSIST_FILE, "rb");
-    if (save) {
-        game = game_load(save);
-        fclose(save);
-        game->speed = SPEED_FACTOR;
-        unlink(PERSIST_FILE);
-    } else {
-        game = game_create(xorshift(&rand_state));
-        game->speed = SPEED_FACTOR;
+    long target = game->time;
+    bool chosen = false;
+    int key = 0;
+    do {
+        switch (key) {
+        case ARROW_L:
+            target -= HOUR;
+            break;
+        case ARROW_R:
+            target += HOUR;
+            break;
+        case ARROW_D:
+            target -= DAY;
+            break;
+        case ARROW_U:
+            target += DAY;
+            break;
+        case 13:
+            chosen = true;
+            break;
+        }
+        if (target < start)
+            target = start;
+        if (target > game->time)
+            target = game->time;
+        if (chosen)
+            break;
+        timeline_seek(&s->timeline, target, preview);
+        char date[128];
+        game_date(preview, date);
+        for (int ty = sidey + 4; ty < sidey + 9; ty++)
+            for (int tx = 1; tx < info.w - 1; tx++)
+                panel_putc(&info, tx, ty, FONT(K, k), 0x2591);
+        panel_printf(&info, 2, sidey + 4, "Wk{%s}", date);
+        panel_printf(&info, 2, sidey + 5, "Gold: Yk{%ld}", (long)preview->gold);
+        panel_printf(&info, 2, sidey + 6, "Food: Yk{%ld}", (long)preview->food);
+        panel_printf(&info, 2, sidey + 7, "Wood: Yk{%ld}", (long)preview->wood);
+        panel_printf(&info, 2, sidey + 8, "Pop.: %ld",
+                     (long)preview->population);
+        panel_clear(&s->buildings);
+        map_draw_buildings(&preview->map, preview->time, &s->buildings);
+        panel_clear(&s->units);
+        game_draw_units(preview, &s->units, false);
+    } while (!is_exit_key(key = game_getch(s)));
+    display_pop_free(&s->display);
+
+    if (chosen && timeline_seek(&s->timeline, target, preview)) {
+        int speed = game->speed;
+        game_copy(game, preview);
+        game->speed = speed;
+        timeline_branch(&s->timeline, game);
+        /* The journal cannot express going back in time. */
+        if (!s->replay.playing)
+            journal_compact(&s->journal, game);
     }
-    atexit_save_game = game;
-    atexit(atexit_save);
-    display_pop_free();
+    game_free(preview);
+}
 
-    panel_t sidemenu;
-    panel_init(&sidemenu, DISPLAY_WIDTH - SIDEMENU_WIDTH, 0,
-               SIDEMENU_WIDTH, DISPLAY_HEIGHT);
-    display_push(&sidemenu);
+/* Read a slot name into NAME. Returns false if cancelled. */
+static bool
+popup_name(session_t *s, char *name)
+{
+    panel_t p;
+    panel_center_init(&p, &s->display, SLOT_NAME_MAX + 8, 3);
+    display_push(&s->display, &p);
+    size_t length = strlen(name);
+    bool accepted = false;
+    for (;;) {
+        panel_fill(&p, FONT_DEFAULT, ' ');
+        panel_puts(&p, 1, 1, FONT(Y, k), "Name:");
+        panel_puts(&p, 7, 1, FONT(W, k), name);
+        panel_puts(&p, 7 + length, 1, FONT(R, k), "_");
+        display_refresh(&s->display);
+        int key = session_getch(s);
+        if (key == 27 || key == KEY_INTERRUPT)
+            break;
+        if (key == 13 && slot_name_valid(name)) {
+            accepted = true;
+            break;
+        }
+        if ((key == 8 || key == 127) && length > 0) {
+            name[--length] = '\0';
+        } else if (length < SLOT_NAME_MAX - 1 && key < 128 &&
+                   (isalnum(key) || key == '-' || key == '_')) {
+            name[length++] = key;
+            name[length] = '\0';
+        }
+    }
+    display_pop_free(&s->display);
+    display_refresh(&s->display);
+    return accepted;
+}
 
-    panel_t terrain;
-    panel_init(&terrain, 0, 0, MAP_WIDTH, MAP_HEIGHT);
-    display_push(&terrain);
+static bool
+popup_confirm(session_t *s, const char *name)
+{
+    panel_t popup;
+    char text[SLOT_NAME_MAX + 32];
+    snprintf(text, sizeof(text), "Delete Yk{%s}? (Rk{y}/Rk{n})", name);
+    panel_center_init(&popup, &s->display, panel_strlen(text) + 2, 3);
+    panel_printf(&popup, 1, 1, "%s", text);
+    display_push(&s->display, &popup);
+    display_refresh(&s->display);
+    int input = session_getch(s);
+    display_pop_free(&s->display);
+    display_refresh(&s->display);
+    return input == 'y' || input == 'Y';
+}
 
-    panel_t buildings;
-    panel_init(&buildings, 0, 0, MAP_WIDTH, MAP_HEIGHT);
-    display_push(&buildings);
+/* Pick the slot to play into s->slot. Only the entries on the visible
+ * page are decoded from the index. Returns false to quit. */
+static bool
+ui_slots(session_t *s)
+{
+    slot_index_t index;
+    slot_index_open(&index, SLOT_INDEX);
+    strcpy(s->slot, SLOT_DEFAULT);
+    if (index.count == 0) {
+        slot_index_close(&index);
+        return true;
+    }
 
-    panel_t units;
-    panel_init(&units, 0, 0, MAP_WIDTH, MAP_HEIGHT);
-    display_push(&units);
+    panel_t p;
+    int w = 72;
+    int h = 22;
+    panel_center_init(&p, &s->display, w, h);
+    display_push(&s->display, &p);
+    int per_page = h - 4;
+    int page = 0;
+    int selection = 0;
+    int key = 0;
+    bool chosen = false;
+    do {
+        int page_max = (index.count - 1) / per_page;
+        switch (key) {
+        case ARROW_U:
+            if (selection > page * per_page)
+                selection--;
+            break;
+        case ARROW_D:
+            if (selection < (page + 1) * per_page - 1 &&
+                selection < index.count - 1)
+                selection++;
+            break;
+        case '>':
+            if (page < page_max) {
+                page++;
+                selection = page * per_page;
+            }
+            break;
+        case '<':
+            if (page > 0) {
+                page--;
+                selection = page * per_page;
+            }
+            break;
+        case 13: {
+            slot_t slot;
+            if (slot_index_get(&index, selection, &slot)) {
+                strcpy(s->slot, slot.name);
+                chosen = true;
+            }
+        } break;
+        case 'n': {
+            char name[SLOT_NAME_MAX] = "";
+            if (!popup_name(s, name))
+                break;
+            if (slot_index_find(&index, name) >= 0) {
+                popup_message(s, font_error, "A save named %s exists!", name);
+            } else {
+                strcpy(s->slot, name);
+                chosen = true;
+            }
+        } break;
+        case 'd': {
+            slot_t slot;
+            if (slot_index_get(&index, selection, &slot) &&
+                popup_confirm(s, slot.name)) {
+                slot_index_close(&index);
+                slot_delete(SLOT_INDEX, slot.name);
+                slot_index_open(&index, SLOT_INDEX);
+                if (selection >= index.count)
+                    selection = index.count - 1;
+                if (selection < 0) {
+                    chosen = true; // nothing left, start fresh
+                    selection = 0;
+                }
+                page = selection / per_page;
+            }
+        } break;
+        }
+        if (chosen)
+            break;
 
-    /* Main Loop */
+        panel_fill(&p, FONT_DEFAULT, ' ');
+        panel_border(&p, FONT(w, k));
+        panel_printf(&p, w / 2 - 5, 1, "yk{Saved Games}");
+        panel_printf(&p, 1, 2, "wk{Name                    Date"
+                     "               Pop.   Gold   Food   Wood}");
+        for (int i = 0; i < per_page; i++) {
+            int si = page * per_page + i;
+            if (si >= index.count)
+                break;
+            slot_t slot;
+            char format[] = "Ck{%-23s} %-17s %5ld %6ld %6ld %6ld";
+            if (selection == si)
+                format[1] = 'r';
+            if (slot_index_get(&index, si, &slot))
+                panel_printf(&p, 1, i + 3, format, slot.name, slot.date,
+                             (long)slot.population, (long)slot.gold,
+                             (long)slot.food, (long)slot.wood);
+            else
+                panel_printf(&p, 1, i + 3, "Kk{(damaged entry)}");
+        }
+        panel_printf(&p, 1, h - 1, "Rk{<} wk{Page %d/%d} Rk{>}  "
+                     "Rk{enter} load  Rk{n}ew  Rk{d}elete  Rk{q}uit",
+                     page + 1, page_max + 1);
+        display_refresh(&s->display);
+    } while (!is_exit_key(key = session_getch(s)));
+    display_pop_free(&s->display);
+    slot_index_close(&index);
+    return chosen;
+}
+
+/* Record the slot's current state in the index. */
+static void
+session_index(session_t *s)
+{
+    slot_t slot;
+    slot_describe(&slot, s->slot, s->game);
+    slot_index_update(SLOT_INDEX, &slot);
+    s->indexed = s->journal.saved;
+}
+
+static void
+session_draw(session_t *s, yield_t diff)
+{
+    sidemenu_draw(&s->sidemenu, s->game, diff);
+    if (s->journal.child)
+        sidemenu_set(&s->sidemenu, FIELD_NOTICE, "Kk{Autosaving ...}");
+    else if (device_uepoch() - s->journal.saved < AUTOSAVE_NOTICE)
+        sidemenu_set(&s->sidemenu, FIELD_NOTICE, "Kk{Autosaved}");
+    else if (s->budget.period > PERIOD || !s->budget.animate)
+        sidemenu_set(&s->sidemenu, FIELD_NOTICE, "Kk{Slow: %d fps}",
+                     (int)(1000000 / s->budget.period));
+    else
+        sidemenu_set(&s->sidemenu, FIELD_NOTICE, "%s", "");
+    map_draw_terrain(&s->terrain_cache, &s->game->map, s->game->map_seed);
+    panel_clear(&s->buildings);
+    map_draw_buildings(&s->game->map, s->game->time, &s->buildings);
+    panel_clear(&s->units);
+    game_draw_units(s->game, &s->units, false);
+    display_refresh(&s->display);
+}
+
+static void
+session_run(session_t *s)
+{
+    game_t *game = s->game;
     bool running = true;
+    uint64_t deadline = device_clock();
     while (running) {
         yield_t diff;
         for (int i = 0; running && i < game->speed; i++) {
             diff = game_step(game);
             enum game_event event;
             while ((event = game_event_pop(game)) != EVENT_NONE) {
-                sidemenu_draw(&sidemenu, game, diff);
-                display_refresh();
+                sidemenu_draw(&s->sidemenu, game, diff);
+                display_refresh(&s->display);
                 switch (event) {
                 case EVENT_LOSE:
-                    atexit_save_game = NULL;
+                    s->save_on_exit = false;
                     running = false;
-                    ui_gameover(game, &terrain);
+                    ui_gameover(s);
                 break;
                 case EVENT_PROGRESS_1:
-                    ui_halfway(game, &terrain);
+                    ui_halfway(s);
                     break;
                 case EVENT_WIN:
-                    atexit_save_game = NULL;
+                    s->save_on_exit = false;
                     running = false;
-                    ui_win(game, &terrain);
+                    ui_win(s);
                     break;
                 case EVENT_BATTLE:
-                    ui_apology(game, &terrain);
+                    ui_apology(s);
                     break;
                 case EVENT_NONE:
                     break;
                 }
             }
+            if (s->interrupted)
+                running = false;
         }
 
-        sidemenu_draw(&sidemenu, game, diff);
-        map_draw_terrain(game->map, &terrain);
-        panel_clear(&buildings);
-        map_draw_buildings(game->map, &buildings);
-        panel_clear(&units);
-        game_draw_units(game, &units, false);
-        display_refresh();
-        uint64_t wait = device_uepoch() % PERIOD;
-        if (device_kbhit(wait)) {
-            int key = device_getch();
+        if (session_due(s))
+            session_draw(s, diff);
+        replay_tick(&s->replay, game);
+        timeline_update(&s->timeline, game);
+        if (running && !s->replay.playing) {
+            journal_autosave(&s->journal, game);
+            if (s->journal.saved != s->indexed)
+                session_index(s);
+        }
+        /* Frames fall due at fixed intervals. Keys arriving in
+         * between are handled as they come, without advancing the
+         * game. After falling behind, e.g. while a UI screen was up,
+         * pacing restarts from now rather than catching up. */
+        deadline += PERIOD;
+        uint64_t now = device_clock();
+        if (deadline + PERIOD < now)
+            deadline = now;
+        while (running && session_kbhit(s, deadline)) {
+            int key = session_getch(s);
             switch (key) {
             case 'b':
-                ui_build(game, &terrain);
+                ui_build(s);
                 break;
             case 's':
-                ui_squads(game, &terrain, &units);
+                ui_squads(s);
                 break;
             case 'h':
-                ui_heroes(game, &terrain);
+                ui_heroes(s);
+                break;
+            case 'w':
+                ui_rewind(s);
                 break;
             case 't':
-                ui_story(game, &terrain);
+                ui_story(s);
                 break;
             case 'p':
-                ui_help(game, &terrain);
+                ui_help(s);
                 break;
             case '>':
             case '.':
@@ -772,34 +1217,244 @@ main(void)
                     game->speed = 1;
                 break;
             case 'R':
-                display_invalidate();
+                display_invalidate(&s->display);
                 break;
             case 'q':
-                running = !popup_quit(true);
+                running = !popup_quit(s, true);
                 break;
             case 'Q':
-                running = !popup_quit(false);
+                running = !popup_quit(s, false);
                 if (!running)
-                    atexit_save_game = NULL;
+                    s->save_on_exit = false;
                 break;
             default:
                 break;
             }
+            /* The timeline only keeps game states, not the commands
+             * that led to them. */
+            if (key == 'b' || key == 's' || key == 'h')
+                timeline_mark(&s->timeline, game);
+            if (s->interrupted)
+                running = false;
+            if (running)
+                session_draw(s, diff);
         }
-    };
-
-    atexit_save();
-    atexit_save_game = NULL;
-    game_free(game);
-
-    display_pop(); // units
-    display_pop(); // buildings
-    display_pop(); // terrain
-    display_pop(); // sidemenu
-    panel_free(&units);
-    panel_free(&buildings);
-    panel_free(&terrain);
-    panel_free(&sidemenu);
-    display_free();
+        if (s->interrupted)
+            running = false;
+    }
+}
+
+/* The panels the main loop draws the game into. False if there was
+ * no memory for them, though they are still pushed and must be freed. */
+static bool
+session_panels_init(session_t *s)
+{
+    bool ok = sidemenu_init(&s->sidemenu, &s->display);
+    display_push(&s->display, &s->sidemenu.panel);
+    budget_init(&s->budget);
+    ok &= panel_init(&s->terrain, &s->display, 0, 0, MAP_WIDTH, MAP_HEIGHT);
+    map_terrain_init(&s->terrain_cache, &s->terrain);
+    display_push(&s->display, &s->terrain);
+    ok &= panel_init(&s->buildings, &s->display, 0, 0, MAP_WIDTH, MAP_HEIGHT);
+    display_push(&s->display, &s->buildings);
+    ok &= panel_init(&s->units, &s->display, 0, 0, MAP_WIDTH, MAP_HEIGHT);
+    display_push(&s->display, &s->units);
+    return ok;
+}
+
+static void
+session_panels_free(session_t *s)
+{
+    display_pop(&s->display); // units
+    display_pop(&s->display); // buildings
+    display_pop(&s->display); // terrain
+    display_pop(&s->display); // sidemenu
+    panel_free(&s->units);
+    panel_free(&s->buildings);
+    panel_free(&s->terrain);
+    panel_free(&s->sidemenu.panel);
+}
+
+/* Play a recording back without a terminal and check that it ends in
+ * the recorded state. */
+static int
+replay_main(const char *path)
+{
+    session_t session = {.save_on_exit = false};
+    session_t *s = &session;
+    s->game = replay_open(&s->replay, path);
+    if (!s->game) {
+        fprintf(stderr, "gcom: could not read recording %s\n", path);
+        return EXIT_FAILURE;
+    }
+    /* Render every frame onto a virtual terminal, so a replay also
+     * measures the terminal output the session would have produced. */
+    vterm_t *vt = malloc(sizeof(*vt));
+    if (!vt) {
+        replay_close(&s->replay, s->game);
+        game_free(s->game);
+        fprintf(stderr, "gcom: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    vterm_init(vt);
+    if (!(s->device = device_init_virtual(vt))) {
+        replay_close(&s->replay, s->game);
+        game_free(s->game);
+        free(vt);
+        fprintf(stderr, "gcom: could not create a virtual terminal\n");
+        return EXIT_FAILURE;
+    }
+    display_init(&s->display, s->device);
+    if (!session_panels_init(s)) {
+        session_panels_free(s);
+        replay_close(&s->replay, s->game);
+        game_free(s->game);
+        display_free(&s->display);
+        device_free(s->device);
+        free(vt);
+        fprintf(stderr, "gcom: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    timeline_init(&s->timeline, s->game, TIMELINE_BUDGET);
+    uint64_t start = device_uepoch();
+    session_run(s);
+    double elapsed = (device_uepoch() - start) / 1e6;
+    long keys = s->replay.keys;
+    bool reproduced = replay_close(&s->replay, s->game);
+    char date[128];
+    game_date(s->game, date);
+    const char *result = "DIVERGED";
+    if (s->replay.verified)
+        result = "reproduced";
+    else if (reproduced)
+        result = "recording cut short, no final checksum";
+    printf("%ld keys to %s in %.3f s, checksum %08lx: %s\n",
+           keys, date, elapsed, (unsigned long)game_checksum(s->game),
+           result);
+    if (s->replay.diverged)
+        printf("first diverged on day %ld\n",
+               s->replay.diverged_at / (long)DAY);
+    vterm_stats_t *vs = &vt->stats;
+    double frames = vs->frames ? vs->frames : 1;
+    printf("%llu frames, %.0f bytes, %.1f moves, %.1f colors per frame%s\n",
+           (unsigned long long)vs->frames, vs->bytes / frames,
+           vs->moves / frames, vs->colors / frames,
+           vterm_matches(vt, &s->display) ? "" : ", SCREEN MISMATCH");
+    session_panels_free(s);
+    timeline_free(&s->timeline);
+    game_free(s->game);
+    display_free(&s->display);
+    device_free(s->device);
+    free(vt);
+    return reproduced ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void
+usage(FILE *out)
+{
+    fprintf(out, "usage: gcom [-r recording] [-p recording]\n"
+            "  -r FILE  record this session's input to FILE\n"
+            "  -p FILE  play back a recording without a terminal\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *record = NULL;
+    int option;
+    while ((option = getopt(argc, argv, "r:p:h")) != -1) {
+        switch (option) {
+        case 'r':
+            record = optarg;
+            break;
+        case 'p':
+            return replay_main(optarg);
+        case 'h':
+            usage(stdout);
+            exit(EXIT_SUCCESS);
+        default:
+            usage(stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    session_t session = {.save_on_exit = true};
+    session_t *s = &session;
+    int w, h;
+    if (!(s->device = device_init())) {
+        fprintf(stderr, "gcom: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    display_init(&s->display, s->device);
+    device_terminal_size(s->device, &w, &h);
+    if (w < DISPLAY_WIDTH || h < DISPLAY_HEIGHT) {
+        display_free(&s->display);
+        device_free(s->device);
+        printf("Goblin-COM requires a terminal of at least %dx%d characters!\n"
+               "I see %dx%d\n"
+               "Press enter to exit ...\n",
+               DISPLAY_WIDTH, DISPLAY_HEIGHT, w, h);
+        fflush(stdout);
+        getchar();
+        exit(EXIT_FAILURE);
+    }
+    uint64_t seed;
+    device_entropy(&seed, sizeof(seed));
+    device_title(s->device, "Goblin-COM");
+    if (!ui_slots(s)) {
+        display_free(&s->display);
+        device_free(s->device);
+        return 0;
+    }
+    slot_paths(s->slot, s->snapshot_path, s->journal_path);
+
+    panel_t loading;
+    uint8_t loading_message[] = "Initializing world ...";
+    panel_center_init(&loading, &s->display, sizeof(loading_message), 1);
+    display_push(&s->display, &loading);
+    panel_puts(&loading, 0, 0, FONT_DEFAULT, (char *)loading_message);
+    display_refresh(&s->display);
+    /* A corrupt or outdated save is dropped for a fresh game. */
+    s->game = journal_recover(s->snapshot_path, s->journal_path);
+    if (!s->game) {
+        uint64_t map_seed = xorshift(&seed);
+        s->game = game_create(map_seed, xorshift(&seed));
+    }
+    s->game->speed = SPEED_FACTOR;
+    journal_init(&s->journal, s->snapshot_path, s->journal_path, s->game);
+    session_index(s);
+    timeline_init(&s->timeline, s->game, TIMELINE_BUDGET);
+    display_pop_free(&s->display);
+
+    if (!session_panels_init(s)) {
+        session_panels_free(s);
+        journal_close(&s->journal);
+        timeline_free(&s->timeline);
+        game_free(s->game);
+        display_free(&s->display);
+        device_free(s->device);
+        fprintf(stderr, "gcom: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    if (record && !replay_record(&s->replay, record, s->game))
+        popup_message(s, font_error, "Could not record to %s!", record);
+
+    session_run(s);
+    replay_close(&s->replay, s->game);
+
+    if (s->save_on_exit) {
+        journal_compact(&s->journal, s->game);
+        journal_close(&s->journal);
+        session_index(s);
+    } else {
+        journal_remove(&s->journal);
+        slot_index_remove(SLOT_INDEX, s->slot);
+    }
+    timeline_free(&s->timeline);
+    game_free(s->game);
+
+    session_panels_free(s);
+    display_free(&s->display);
+    device_free(s->device);
     return 0;
 }
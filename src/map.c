@@ -59,8 +59,11 @@ grow(const float *map, size_t size, float *out, uint64_t *seed)
     return osize;
 }
 
+/* Full-resolution heightmap, only needed while generating. */
+typedef float lowres_t[MAP_HEIGHT * MAP_HEIGHT];
+
 static void
-summarize(map_t *map, uint64_t *seed)
+summarize(map_t *map, lowres_t *low, uint64_t *seed)
 {
     for (size_t y = 0; y < MAP_HEIGHT; y++) {
         for (size_t x = 0; x < MAP_WIDTH; x++) {
@@ -69,7 +72,7 @@ summarize(map_t *map, uint64_t *seed)
                 for (size_t sx = 0; sx < MAP_WIDTH; sx++) {
                     size_t ix = x * MAP_WIDTH + sx;
                     size_t iy = y * MAP_HEIGHT + sy;
-                    mean += map->low[ix][iy].height;
+                    mean += low[ix][iy];
                 }
             }
             mean /= (MAP_WIDTH * MAP_HEIGHT);
@@ -78,7 +81,7 @@ summarize(map_t *map, uint64_t *seed)
                 for (size_t sx = 0; sx < MAP_WIDTH; sx++) {
                     size_t ix = x * MAP_WIDTH + sx;
                     size_t iy = y * MAP_HEIGHT + sy;
-                    float diff = mean - map->low[ix][iy].height;
+                    float diff = mean - low[ix][iy];
                     std += diff * diff;
                 }
             }
@@ -100,14 +103,15 @@ summarize(map_t *map, uint64_t *seed)
                 base = BASE_FOREST;
             map->high[x][y].base = base;
             map->high[x][y].building = 0;
+            map->high[x][y].building_ready = 0;
         }
     }
 }
 
-map_t *
-map_generate(uint64_t seed)
+void
+map_generate(map_t *map, uint64_t seed)
 {
-    map_t *map = malloc(sizeof(*map));
+    lowres_t *low = malloc(sizeof(lowres_t) * MAP_WIDTH * MAP_WIDTH);
     size_t alloc_size = WORK_SIZE * WORK_SIZE * sizeof(float);
     float *buf_a = calloc(alloc_size, 1);
     float *buf_b = calloc(alloc_size, 1);
@@ -127,38 +131,33 @@ map_generate(uint64_t seed)
             float sx = x / (float)(MAP_WIDTH * MAP_WIDTH) - 0.5;
             float sy = y / (float)(MAP_HEIGHT * MAP_HEIGHT) - 0.5;
             float s = sqrt(sx * sx + sy * sy) * 3 - 0.45f;
-            map->low[x][y].height = height - s;
+            low[x][y] = height - s;
         }
     }
     free(buf_a);
     free(buf_b);
-    summarize(map, &seed);
-    return map;
+    summarize(map, low, &seed);
+    free(low);
 }
 
-void
-map_free(map_t *map)
-{
-    free(map);
-}
+/* The surf rolls outward from the island's center: a coast tile is
+ * bright for half of each cycle, starting at a phase set by its
+ * distance from the center. */
+#define COAST_PERIOD 3141593 // usec per cycle
+#define COAST_STEP   (COAST_PERIOD / COAST_STEPS)
 
 static font_t
-base_font(enum map_base base, int x, int y)
+base_font(enum map_base base, bool bright)
 {
     font_t font;
     switch (base) {
     case BASE_OCEAN:
         font = FONT(B, b);
         break;
-    case BASE_COAST: {
+    case BASE_COAST:
         font = FONT(w, b);
-        float dx = (x / (float)MAP_WIDTH) - 0.5;
-        float dy = (y / (float)MAP_HEIGHT) - 0.5;
-        dx *= 1.3;
-        float dist = sqrt(dx * dx + dy * dy) * 100;
-        float offset = fmod(device_uepoch() / 500000.0, PI * 2);
-        font.fore_bright = sinf(dist + offset) < 0 ? true : false;
-    } break;
+        font.fore_bright = bright;
+        break;
     case BASE_GRASSLAND:
         font = FONT(G, g);
         break;
@@ -178,20 +177,121 @@ base_font(enum map_base base, int x, int y)
     return font;
 }
 
+static bool
+coast_bright(terrain_t *t, int x, int y, uint64_t step)
+{
+    return (t->phase[x][y] + step) % COAST_STEPS >= COAST_STEPS / 2;
+}
+
 void
-map_draw_terrain(map_t *map, panel_t *p)
+map_terrain_init(terrain_t *t, panel_t *p)
 {
-    for (size_t y = 0; y < MAP_HEIGHT; y++) {
-        for (size_t x = 0; x < MAP_WIDTH; x++) {
-            uint16_t c = map->high[x][y].base;
-            font_t font = base_font(c, x, y);
-            panel_putc(p, x, y, font, c);
+    t->panel = p;
+    t->drawn = false;
+    t->still = false;
+    for (int y = 0; y < MAP_HEIGHT; y++) {
+        for (int x = 0; x < MAP_WIDTH; x++) {
+            float dx = (x / (float)MAP_WIDTH) - 0.5;
+            float dy = (y / (float)MAP_HEIGHT) - 0.5;
+            dx *= 1.3;
+            float dist = sqrt(dx * dx + dy * dy) * 100;
+            /* sin(dist + offset) < 0 in the original continuous form */
+            float phase = fmod(dist / (PI * 2), 1.0) * COAST_STEPS;
+            t->phase[x][y] = (int)(phase + 0.5f) % COAST_STEPS;
+        }
+    }
+}
+
+/* Bucket the coast tiles by the steps at which their shade flips. */
+static void
+terrain_index(terrain_t *t, map_t *map)
+{
+    int count[COAST_STEPS] = {0};
+    for (int y = 0; y < MAP_HEIGHT; y++) {
+        for (int x = 0; x < MAP_WIDTH; x++) {
+            if (map->high[x][y].base == BASE_COAST) {
+                int on = (COAST_STEPS * 3 / 2 - t->phase[x][y]) % COAST_STEPS;
+                int off = (COAST_STEPS - t->phase[x][y]) % COAST_STEPS;
+                count[on]++;
+                count[off]++;
+            }
         }
     }
+    t->first[0] = 0;
+    for (int i = 0; i < COAST_STEPS; i++)
+        t->first[i + 1] = t->first[i] + count[i];
+    int fill[COAST_STEPS];
+    for (int i = 0; i < COAST_STEPS; i++)
+        fill[i] = t->first[i];
+    for (int y = 0; y < MAP_HEIGHT; y++) {
+        for (int x = 0; x < MAP_WIDTH; x++) {
+            if (map->high[x][y].base == BASE_COAST) {
+                int on = (COAST_STEPS * 3 / 2 - t->phase[x][y]) % COAST_STEPS;
+                int off = (COAST_STEPS - t->phase[x][y]) % COAST_STEPS;
+                t->flips[fill[on]++] = x * MAP_HEIGHT + y;
+                t->flips[fill[off]++] = x * MAP_HEIGHT + y;
+            }
+        }
+    }
+}
+
+/* Draw the terrain of MAP, which was generated from SEED. */
+void
+map_draw_terrain(terrain_t *t, map_t *map, uint64_t seed)
+{
+    uint64_t step = device_clock() / COAST_STEP;
+    if (t->still && t->drawn)
+        step = t->step;
+    if (!t->drawn || t->seed != seed) {
+        for (int y = 0; y < MAP_HEIGHT; y++) {
+            for (int x = 0; x < MAP_WIDTH; x++) {
+                uint16_t c = map->high[x][y].base;
+                font_t font = base_font(c, coast_bright(t, x, y, step));
+                panel_putc(t->panel, x, y, font, c);
+            }
+        }
+        terrain_index(t, map);
+        t->drawn = true;
+        t->seed = seed;
+    } else if (step != t->step) {
+        /* Visit every step passed since the last draw, at most a
+         * cycle's worth, and redraw the tiles that flipped on it. */
+        uint64_t from = t->step + 1;
+        if (step - t->step > COAST_STEPS)
+            from = step - COAST_STEPS + 1;
+        for (uint64_t i = from; i <= step; i++) {
+            int bucket = i % COAST_STEPS;
+            for (int j = t->first[bucket]; j < t->first[bucket + 1]; j++) {
+                int x = t->flips[j] / MAP_HEIGHT;
+                int y = t->flips[j] % MAP_HEIGHT;
+                bool bright = coast_bright(t, x, y, step);
+                font_t font = base_font(BASE_COAST, bright);
+                panel_putc(t->panel, x, y, font, BASE_COAST);
+            }
+        }
+    }
+    t->step = step;
+}
+
+/* The device_clock() time the drawn terrain next changes, or
+ * DEVICE_FOREVER if it is still. */
+uint64_t
+map_terrain_due(terrain_t *t)
+{
+    if (!t->drawn)
+        return 0;
+    if (t->still)
+        return DEVICE_FOREVER;
+    for (uint64_t i = t->step + 1; i <= t->step + COAST_STEPS; i++) {
+        int bucket = i % COAST_STEPS;
+        if (t->first[bucket] != t->first[bucket + 1])
+            return i * COAST_STEP;
+    }
+    return DEVICE_FOREVER;
 }
 
 void
-map_draw_buildings(map_t *map, panel_t *p)
+map_draw_buildings(map_t *map, long time, panel_t *p)
 {
     for (size_t y = 0; y < MAP_HEIGHT; y++) {
         for (size_t x = 0; x < MAP_WIDTH; x++) {
@@ -199,7 +299,7 @@ map_draw_buildings(map_t *map, panel_t *p)
             if (building != C_NONE) {
                 uint16_t c = building;
                 font_t font = FONT(Y, k);
-                if (map->high[x][y].building_age < 0) {
+                if (time < map->high[x][y].building_ready) {
                     font.fore = COLOR_CYAN;
                     c = tolower(c);
                 }
@@ -30,22 +30,37 @@ enum building {
     C_FARM = 'F'
 };
 
+/* Plain data with no pointers, so a map is copied by assignment. */
 typedef struct map {
     struct {
         uint16_t base;
         uint16_t building;
-        long building_age;
+        long building_ready; // game time when production starts
     } high[MAP_WIDTH][MAP_HEIGHT];
-    struct {
-        float height;
-    } low[MAP_WIDTH * MAP_WIDTH][MAP_HEIGHT * MAP_HEIGHT];
 } map_t;
 
-map_t *map_generate(uint64_t seed);
-void   map_free(map_t *map);
+/* Terrain as last drawn into a panel. The terrain of a map never
+ * changes, so after the first draw only the animated coast is redrawn,
+ * and then only the tiles whose shade flips. */
+#define COAST_STEPS 64 // animation steps per cycle of the surf
+
+typedef struct terrain {
+    panel_t *panel;
+    bool drawn;
+    uint64_t seed;     // of the map drawn
+    uint64_t step;     // coast animation step drawn
+    bool still;        // hold the coast at that step, e.g. on a slow link
+    uint8_t phase[MAP_WIDTH][MAP_HEIGHT];
+    uint16_t first[COAST_STEPS + 1]; // coast tiles flipping at each step
+    uint16_t flips[MAP_WIDTH * MAP_HEIGHT * 2];
+} terrain_t;
+
+void   map_generate(map_t *, uint64_t seed);
 
-void   map_draw_terrain(map_t *, panel_t *);
-void   map_draw_buildings(map_t *, panel_t *);
+void   map_terrain_init(terrain_t *, panel_t *);
+void   map_draw_terrain(terrain_t *, map_t *, uint64_t seed);
+uint64_t map_terrain_due(terrain_t *);
+void   map_draw_buildings(map_t *, long time, panel_t *);
 
 uint16_t map_base(map_t *, int x, int y);
 uint16_t map_building(map_t *, int x, int y);
@@ -0,0 +1,221 @@
+#include <string.h>
+#include <limits.h>
+#include "policy.h"
+#include "rand.h"
+
+static inline int
+castle_distance(int x, int y)
+{
+    int dx = x - CASTLE_X;
+    int dy = y - CASTLE_Y;
+    return dx * dx + dy * dy;
+}
+
+/* Planned daily income, counting buildings still under construction,
+ * plus an optional per-building tally indexed by building glyph. */
+static yield_t
+policy_census(game_t *game, int counts[128])
+{
+    yield_t income = {0, 0, 0};
+    if (counts)
+        memset(counts, 0, sizeof(counts[0]) * 128);
+    for (int y = 0; y < MAP_HEIGHT; y++) {
+        for (int x = 0; x < MAP_WIDTH; x++) {
+            uint16_t building = map_building(&game->map, x, y);
+            yield_t yield = building_yield(building);
+            income.gold += yield.gold;
+            income.food += yield.food;
+            income.wood += yield.wood;
+            if (counts && building < 128)
+                counts[building]++;
+        }
+    }
+    return income;
+}
+
+/* Extend the road network one tile towards the closest open terrain
+ * that suits BUILDING. */
+static bool
+policy_road(game_t *game, uint16_t building)
+{
+    int tx = -1;
+    int ty = -1;
+    int best = INT_MAX;
+    for (int y = 0; y < MAP_HEIGHT; y++) {
+        for (int x = 0; x < MAP_WIDTH; x++) {
+            int d = castle_distance(x, y);
+            if (d < best && map_building(&game->map, x, y) == C_NONE &&
+                building_fits(building, map_base(&game->map, x, y))) {
+                tx = x;
+                ty = y;
+                best = d;
+            }
+        }
+    }
+    if (tx < 0 || !game_can_afford(game, building_cost(C_ROAD)))
+        return false;
+    int rx = -1;
+    int ry = -1;
+    best = INT_MAX;
+    for (int y = 0; y < MAP_HEIGHT; y++) {
+        for (int x = 0; x < MAP_WIDTH; x++) {
+            int dx = x - tx;
+            int dy = y - ty;
+            int d = dx * dx + dy * dy;
+            if (d < best && game_can_build(game, C_ROAD, x, y)) {
+                rx = x;
+                ry = y;
+                best = d;
+            }
+        }
+    }
+    return rx >= 0 && game_build(game, C_ROAD, rx, ry);
+}
+
+/* Build as close to the castle as possible, laying road when no
+ * suitable tile is reachable. */
+static bool
+policy_place(game_t *game, uint16_t building)
+{
+    if (!game_can_afford(game, building_cost(building)))
+        return false;
+    int bx = -1;
+    int by = -1;
+    int best = INT_MAX;
+    for (int y = 0; y < MAP_HEIGHT; y++) {
+        for (int x = 0; x < MAP_WIDTH; x++) {
+            int d = castle_distance(x, y);
+            if (d < best && game_can_build(game, building, x, y)) {
+                bx = x;
+                by = y;
+                best = d;
+            }
+        }
+    }
+    if (bx < 0)
+        return policy_road(game, building);
+    return game_build(game, building, bx, by);
+}
+
+/* Fill every open hero slot with the strongest of a fresh batch of
+ * candidates, spreading recruits over the first few squads. */
+static void
+policy_hire(game_t *game)
+{
+    for (int slot = 0; slot < game->max_hero; slot++) {
+        if (game->heroes[slot].active)
+            continue;
+        hero_t candidates[HERO_CANDIDATES];
+        game_hero_candidates(game, candidates, countof(candidates));
+        int best = 0;
+        for (int i = 1; i < (int)countof(candidates); i++) {
+            hero_t *a = candidates + i;
+            hero_t *b = candidates + best;
+            if (a->str + a->dex + a->mind > b->str + b->dex + b->mind)
+                best = i;
+        }
+        if (!game_hero_hire(game, slot, candidates[best]))
+            break;
+        int squad = 0;
+        for (int i = 1; i < POLICY_SQUADS; i++)
+            if (game->squads[i].member_count <
+                game->squads[squad].member_count)
+                squad = i;
+        game_hero_assign(game, slot, squad);
+    }
+}
+
+/* Send idle squads after landed invaders nobody is chasing yet. */
+static void
+policy_dispatch(game_t *game)
+{
+    for (int i = 0; i < (int)countof(game->invaders); i++) {
+        invader_t *inv = game->invaders + i;
+        if (!inv->active || inv->embarked)
+            continue;
+        bool chased = false;
+        for (unsigned s = 0; s < countof(game->squads); s++)
+            if (game->squads[s].member_count > 0 &&
+                game->squads[s].target == i)
+                chased = true;
+        for (unsigned s = 0; !chased && s < countof(game->squads); s++) {
+            squad_t *squad = game->squads + s;
+            if (squad->member_count > 0 && squad->target < 0) {
+                game_squad_order(game, s, i);
+                chased = true;
+            }
+        }
+    }
+}
+
+static void
+policy_idle(game_t *game)
+{
+    (void) game;
+}
+
+static void
+policy_defend(game_t *game)
+{
+    policy_dispatch(game);
+}
+
+/* Keep food positive, turn spare gold into lumberyards, and pour all
+ * wood into hamlets for population. */
+static void
+policy_greedy(game_t *game)
+{
+    yield_t income = policy_census(game, NULL);
+    uint16_t choice;
+    if (income.food <= 0)
+        choice = C_FARM;
+    else if (game_can_afford(game, COST_HAMLET))
+        choice = C_HAMLET;
+    else if (income.gold < 2)
+        choice = C_MINE;
+    else
+        choice = C_LUMBERYARD;
+    policy_place(game, choice);
+    policy_dispatch(game);
+}
+
+/* Play the whole build menu: keep food up, add a stable for every
+ * few hamlets, hire into every open slot and hunt every invader. */
+static void
+policy_auto(game_t *game)
+{
+    int counts[128];
+    yield_t income = policy_census(game, counts);
+    uint16_t choice;
+    if (income.food <= 0)
+        choice = C_FARM;
+    else if (counts[C_STABLE] < counts[C_HAMLET] / 4 &&
+             game->max_hero + STABLE_INC <= (int)countof(game->heroes))
+        choice = C_STABLE;
+    else if (game_can_afford(game, COST_HAMLET))
+        choice = C_HAMLET;
+    else if (income.gold < 2)
+        choice = C_MINE;
+    else
+        choice = C_LUMBERYARD;
+    policy_place(game, choice);
+    policy_hire(game);
+    policy_dispatch(game);
+}
+
+const policy_t policies[] = {
+    {"idle",   policy_idle},
+    {"defend", policy_defend},
+    {"greedy", policy_greedy},
+    {"auto",   policy_auto},
+    {NULL, NULL}
+};
+
+const policy_t *
+policy_find(const char *name)
+{
+    for (const policy_t *p = policies; p->name; p++)
+        if (strcmp(p->name, name) == 0)
+            return p;
+    return NULL;
+}
@@ -0,0 +1,20 @@
+/**
+ * Scripted players for headless games. A policy is consulted between
+ * simulation steps and issues the same commands a player would issue
+ * through the UI.
+ */
+#pragma once
+
+#include "game.h"
+
+#define POLICY_PERIOD HOUR
+#define POLICY_SQUADS 4
+
+typedef struct policy {
+    const char *name;
+    void (*step)(game_t *);
+} policy_t;
+
+extern const policy_t policies[];
+
+const policy_t *policy_find(const char *name);
@@ -5,8 +5,6 @@
 
 #define MIN(x, y) ((y) < (x) ? (y) : (x))
 
-uint64_t rand_state = 0;
-
 uint64_t
 xorshift(uint64_t *state) {
     uint64_t x = *state;
@@ -37,13 +35,6 @@ rand_uniform_s(uint64_t *state, float min, float max)
     return u * (max - min) + min;
 }
 
-float
-rand_uniform(float min, float max)
-{
-    return rand_uniform_s(&rand_state, min, max);
-
-}
-
 int
 rand_range_s(uint64_t *state, int min, int max)
 {
@@ -51,31 +42,26 @@ rand_range_s(uint64_t *state, int min, int max)
     return (x % (max - min)) + min;
 }
 
-int
-rand_range(int min, int max)
-{
-    return rand_range_s(&rand_state, min, max);
-}
-
 void
-rand_name(char *name, size_t max)
+rand_name(uint64_t *state, char *name, size_t max)
 {
     /* This thing sucks ... */
     const char *vowels = "aeiou";
     const char *consonants = "bcdfghjklmnpqrstvwxyz";
-    int length = rand_range(6, max);
+    int length = rand_range_s(state, 6, max);
     int spaces = 0;
     int letters = 0;
     for (int i = 0; i < length; i++) {
         float spacep = letters / 3.0f * powf(0.1f, 1.0f / (10 * spaces + 1));
-        if (i > 0 && rand_uniform(0, 1.0) < spacep) {
+        if (i > 0 && rand_uniform_s(state, 0, 1.0) < spacep) {
             name[i] = ' ';
             letters = 0;
         } else {
             if (i % 2)
-                name[i] = consonants[rand_range(0, strlen(consonants))];
+                name[i] = consonants[rand_range_s(state, 0,
+                                                  strlen(consonants))];
             else
-                name[i] = vowels[rand_range(0, strlen(vowels))];
+                name[i] = vowels[rand_range_s(state, 0, strlen(vowels))];
             if (letters == 0)
                 name[i] = toupper((int)name[i]);
             letters++;
@@ -0,0 +1,251 @@
+#include <stdlib.h>
+#include <string.h>
+#include "replay.h"
+#include "serial.h"
+#include "device.h"
+
+/* A recording is a header (magic, version, game speed) with its own
+ * CRC, the starting game in the save format, then records of (op, game
+ * time since the previous record, arguments), each closed by a CRC.
+ * Records are flushed as they are written so that a crashed session
+ * still leaves everything up to the crash. A torn final record simply
+ * ends playback early.
+ */
+
+#define REPLAY_MAGIC   "GCOR"
+#define REPLAY_VERSION 1
+
+enum replay_op {
+    REC_NONE, REC_KEY, REC_CURSOR, REC_END, REC_HASH
+};
+
+static void
+diverge(replay_t *r, game_t *game)
+{
+    if (!r->diverged)
+        r->diverged_at = game->time;
+    r->diverged = true;
+}
+
+/* Recording */
+
+bool
+replay_record(replay_t *r, const char *path, game_t *game)
+{
+    memset(r, 0, sizeof(*r));
+    if (!(r->file = fopen(path, "wb")))
+        return false;
+    r->time = game->time;
+    r->day = game->time / (long)DAY;
+    serial_t s;
+    serial_init(&s, r->file);
+    serial_put(&s, REPLAY_MAGIC, 4);
+    serial_put_uint(&s, REPLAY_VERSION);
+    serial_put_uint(&s, game->speed);
+    serial_put_crc(&s);
+    if (!serial_ok(&s) || !game_save(game, r->file) || fflush(r->file)) {
+        fclose(r->file);
+        r->file = NULL;
+        return false;
+    }
+    return true;
+}
+
+static bool
+record_begin(replay_t *r, serial_t *s, game_t *game, enum replay_op op)
+{
+    if (!r->file || r->playing)
+        return false;
+    serial_init(s, r->file);
+    serial_put_uint(s, op);
+    serial_put_uint(s, game->time - r->time);
+    r->time = game->time;
+    return true;
+}
+
+static void
+record_end(replay_t *r, serial_t *s)
+{
+    serial_put_crc(s);
+    if (!serial_ok(s) || fflush(r->file) != 0) {
+        fclose(r->file); // the recording stops here
+        r->file = NULL;
+    }
+}
+
+void
+replay_key(replay_t *r, game_t *game, int key)
+{
+    serial_t s;
+    if (record_begin(r, &s, game, REC_KEY)) {
+        serial_put_uint(&s, key);
+        record_end(r, &s);
+        r->keys++;
+    }
+}
+
+/* Record a cursor position that came from somewhere other than the
+ * keyboard, such as the placement advisor, which is not reproducible. */
+void
+replay_cursor(replay_t *r, game_t *game, int x, int y)
+{
+    serial_t s;
+    if (record_begin(r, &s, game, REC_CURSOR)) {
+        serial_put_uint(&s, x);
+        serial_put_uint(&s, y);
+        record_end(r, &s);
+    }
+}
+
+static void record_next(replay_t *);
+
+/* Called once per frame: record the game's hash on the first frame of
+ * each game day, or check it against the recording. */
+void
+replay_tick(replay_t *r, game_t *game)
+{
+    if (!r->file)
+        return;
+    if (r->playing) {
+        while (r->op == REC_HASH && r->next_time <= game->time) {
+            if (r->next_time != game->time || r->hash != game_hash(game))
+                diverge(r, game);
+            r->time = r->next_time;
+            record_next(r);
+        }
+    } else if (game->time / (long)DAY > r->day) {
+        serial_t s;
+        r->day = game->time / (long)DAY;
+        if (record_begin(r, &s, game, REC_HASH)) {
+            serial_put_u64(&s, game_hash(game));
+            record_end(r, &s);
+        }
+    }
+}
+
+/* Playback */
+
+/* Read ahead the next record. */
+static void
+record_next(replay_t *r)
+{
+    serial_t s;
+    serial_init(&s, r->file);
+    r->op = serial_get_uint(&s);
+    r->next_time = r->time + serial_get_uint(&s);
+    switch (r->op) {
+    case REC_KEY:
+        r->key = serial_get_uint(&s);
+        break;
+    case REC_CURSOR:
+        r->x = serial_get_uint(&s);
+        r->y = serial_get_uint(&s);
+        break;
+    case REC_END:
+        r->checksum = serial_get_u32(&s);
+        break;
+    case REC_HASH:
+        r->hash = serial_get_u64(&s);
+        break;
+    default:
+        serial_fail(&s);
+    }
+    if (!serial_get_crc(&s))
+        r->op = REC_NONE;
+}
+
+game_t *
+replay_open(replay_t *r, const char *path)
+{
+    memset(r, 0, sizeof(*r));
+    r->playing = true;
+    if (!(r->file = fopen(path, "rb")))
+        return NULL;
+    serial_t s;
+    serial_init(&s, r->file);
+    char magic[4];
+    serial_get(&s, magic, sizeof(magic));
+    uint64_t version = serial_get_uint(&s);
+    uint64_t speed = serial_get_uint(&s);
+    game_t *game = NULL;
+    if (serial_get_crc(&s) && memcmp(magic, REPLAY_MAGIC, 4) == 0 &&
+        version == REPLAY_VERSION && speed > 0 &&
+        (game = game_load(r->file))) {
+        game->speed = speed;
+        r->time = game->time;
+        record_next(r);
+    } else {
+        fclose(r->file);
+        r->file = NULL;
+    }
+    return game;
+}
+
+/* True once the next recorded key is due, i.e. the main loop would
+ * have seen a keypress at this point. */
+bool
+replay_pending(replay_t *r, game_t *game)
+{
+    if (r->op == REC_NONE)
+        return true;
+    return r->next_time <= game->time;
+}
+
+/* The next recorded key. Once the recording runs out, or no longer
+ * fits the game, this returns KEY_INTERRUPT to end the session. */
+int
+replay_getch(replay_t *r, game_t *game)
+{
+    if (r->op != REC_KEY || r->next_time != game->time) {
+        if (r->op != REC_NONE)
+            diverge(r, game);
+        return KEY_INTERRUPT;
+    }
+    int key = r->key;
+    r->time = r->next_time;
+    r->keys++;
+    record_next(r);
+    return key;
+}
+
+bool
+replay_get_cursor(replay_t *r, game_t *game, int *x, int *y)
+{
+    if (r->op != REC_CURSOR || r->next_time != game->time) {
+        diverge(r, game);
+        return false;
+    }
+    *x = r->x;
+    *y = r->y;
+    r->time = r->next_time;
+    record_next(r);
+    return true;
+}
+
+/* Finish a recording with the final checksum, or finish playback by
+ * checking against it. Returns false if the playback did not reproduce
+ * the recorded session. */
+bool
+replay_close(replay_t *r, game_t *game)
+{
+    bool success = true;
+    if (r->file && !r->playing) {
+        serial_t s;
+        if (record_begin(r, &s, game, REC_END)) {
+            serial_put_u32(&s, game_checksum(game));
+            record_end(r, &s);
+        }
+        success = r->file != NULL;
+    } else if (r->playing) {
+        if (r->op == REC_END)
+            success = r->checksum == game_checksum(game);
+        else if (r->op != REC_NONE)
+            success = false; // the session ended early
+        success &= !r->diverged;
+        r->verified = success && r->op == REC_END;
+    }
+    if (r->file)
+        fclose(r->file);
+    r->file = NULL;
+    return success;
+}
@@ -0,0 +1,43 @@
+/**
+ * Input recording. A recording holds the game a session started from
+ * followed by every key the session read, each stamped with the game
+ * time it was read at, and ends with the checksum of the final state.
+ * Since the simulation only advances between keys in the main loop and
+ * stands still while a UI screen is up, feeding the same keys at the
+ * same game times to a session started from the same game reproduces
+ * it exactly, with no terminal attached. A hash of the game is also
+ * recorded once per game day, so playback notices the day a replay
+ * goes astray rather than only that it ended up somewhere else.
+ */
+#pragma once
+
+#include "game.h"
+
+typedef struct replay {
+    FILE *file;
+    bool playing;     // reading a recording back rather than writing one
+    long time;        // game time of the last record
+    long keys;        // keys recorded or played back so far
+    long day;         // game day of the last hash record
+    /* Playback */
+    int op;           // the next record, read ahead
+    long next_time;
+    int key, x, y;
+    uint32_t checksum;
+    bool diverged;    // a record did not fit the replayed game
+    long diverged_at; // game time it was noticed
+    uint64_t hash;
+    bool verified;    // the final checksum was reached and matched
+} replay_t;
+
+bool    replay_record(replay_t *, const char *path, game_t *);
+game_t *replay_open(replay_t *, const char *path);
+bool    replay_close(replay_t *, game_t *);
+
+void    replay_key(replay_t *, game_t *, int key);
+void    replay_cursor(replay_t *, game_t *, int x, int y);
+void    replay_tick(replay_t *, game_t *);
+
+bool    replay_pending(replay_t *, game_t *);
+int     replay_getch(replay_t *, game_t *);
+bool    replay_get_cursor(replay_t *, game_t *, int *x, int *y);
@@ -0,0 +1,219 @@
+#include <string.h>
+#include "serial.h"
+
+/* CRC-32 (IEEE 802.3), half a byte at a time from a 16-entry table. */
+uint32_t
+crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+    };
+    const uint8_t *p = buf;
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ p[i]) & 0xf] ^ (crc >> 4);
+        crc = table[(crc ^ (p[i] >> 4)) & 0xf] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+void
+serial_init(serial_t *s, FILE *file)
+{
+    s->file = file;
+    s->buffer = NULL;
+    s->length = s->position = 0;
+    s->crc = 0;
+    s->error = false;
+}
+
+void
+serial_init_buffer(serial_t *s, const void *buffer, size_t length)
+{
+    serial_init(s, NULL);
+    s->buffer = buffer;
+    s->length = length;
+}
+
+bool
+serial_ok(serial_t *s)
+{
+    return !s->error;
+}
+
+void
+serial_fail(serial_t *s)
+{
+    s->error = true;
+}
+
+/* Writing */
+
+void
+serial_put(serial_t *s, const void *buf, size_t len)
+{
+    if (s->error)
+        return;
+    if (s->file && fwrite(buf, len, 1, s->file) != 1)
+        s->error = true;
+    else
+        s->crc = crc32_update(s->crc, buf, len);
+}
+
+void
+serial_put_uint(serial_t *s, uint64_t v)
+{
+    uint8_t buf[10];
+    size_t len = 0;
+    do {
+        buf[len] = v & 0x7f;
+        v >>= 7;
+        if (v)
+            buf[len] |= 0x80;
+        len++;
+    } while (v);
+    serial_put(s, buf, len);
+}
+
+void
+serial_put_int(serial_t *s, int64_t v)
+{
+    serial_put_uint(s, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+void
+serial_put_u32(serial_t *s, uint32_t v)
+{
+    uint8_t buf[4];
+    for (int i = 0; i < 4; i++)
+        buf[i] = v >> (i * 8);
+    serial_put(s, buf, sizeof(buf));
+}
+
+void
+serial_put_u64(serial_t *s, uint64_t v)
+{
+    uint8_t buf[8];
+    for (int i = 0; i < 8; i++)
+        buf[i] = v >> (i * 8);
+    serial_put(s, buf, sizeof(buf));
+}
+
+void
+serial_put_float(serial_t *s, float f)
+{
+    uint32_t v;
+    memcpy(&v, &f, sizeof(v));
+    serial_put_u32(s, v);
+}
+
+void
+serial_put_double(serial_t *s, double f)
+{
+    uint64_t v;
+    memcpy(&v, &f, sizeof(v));
+    serial_put_u64(s, v);
+}
+
+/* Append the CRC of everything written so far. */
+void
+serial_put_crc(serial_t *s)
+{
+    serial_put_u32(s, s->crc);
+}
+
+/* Reading */
+
+bool
+serial_get(serial_t *s, void *buf, size_t len)
+{
+    if (s->error)
+        return false;
+    if (s->buffer && len <= s->length - s->position) {
+        memcpy(buf, s->buffer + s->position, len);
+        s->position += len;
+    } else if (s->buffer || !s->file || fread(buf, len, 1, s->file) != 1) {
+        s->error = true;
+        memset(buf, 0, len);
+        return false;
+    }
+    s->crc = crc32_update(s->crc, buf, len);
+    return true;
+}
+
+uint64_t
+serial_get_uint(serial_t *s)
+{
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t b;
+        if (!serial_get(s, &b, 1))
+            return 0;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return v;
+    }
+    s->error = true; // overlong encoding
+    return 0;
+}
+
+int64_t
+serial_get_int(serial_t *s)
+{
+    uint64_t v = serial_get_uint(s);
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+uint32_t
+serial_get_u32(serial_t *s)
+{
+    uint8_t buf[4];
+    uint32_t v = 0;
+    if (serial_get(s, buf, sizeof(buf)))
+        for (int i = 0; i < 4; i++)
+            v |= (uint32_t)buf[i] << (i * 8);
+    return v;
+}
+
+uint64_t
+serial_get_u64(serial_t *s)
+{
+    uint8_t buf[8];
+    uint64_t v = 0;
+    if (serial_get(s, buf, sizeof(buf)))
+        for (int i = 0; i < 8; i++)
+            v |= (uint64_t)buf[i] << (i * 8);
+    return v;
+}
+
+float
+serial_get_float(serial_t *s)
+{
+    uint32_t v = serial_get_u32(s);
+    float f;
+    memcpy(&f, &v, sizeof(f));
+    return f;
+}
+
+double
+serial_get_double(serial_t *s)
+{
+    uint64_t v = serial_get_u64(s);
+    double f;
+    memcpy(&f, &v, sizeof(f));
+    return f;
+}
+
+/* Read a trailing CRC and check it against everything read before it. */
+bool
+serial_get_crc(serial_t *s)
+{
+    uint32_t expect = s->crc;
+    uint32_t actual = serial_get_u32(s);
+    if (actual != expect)
+        s->error = true;
+    return !s->error;
+}
@@ -0,0 +1,49 @@
+/**
+ * Portable binary encoding for save files: LEB128 varints, zigzag for
+ * signed values, fixed little-endian IEEE floats, and a running CRC-32
+ * over every byte passed through. Errors are sticky: after the first
+ * short read or write every call is a no-op returning zero, so callers
+ * check serial_ok() once at the end. Writing with a NULL file only
+ * accumulates the CRC, which checksums an encoding without storing it,
+ * and serial_init_buffer() reads from memory, such as a mapped file.
+ */
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct serial {
+    FILE *file;
+    const uint8_t *buffer;
+    size_t length;
+    size_t position;
+    uint32_t crc;
+    bool error;
+} serial_t;
+
+uint32_t crc32_update(uint32_t crc, const void *, size_t);
+
+void     serial_init(serial_t *, FILE *);
+void     serial_init_buffer(serial_t *, const void *, size_t);
+bool     serial_ok(serial_t *);
+void     serial_fail(serial_t *);
+
+void     serial_put(serial_t *, const void *, size_t);
+void     serial_put_uint(serial_t *, uint64_t);
+void     serial_put_int(serial_t *, int64_t);
+void     serial_put_u32(serial_t *, uint32_t);
+void     serial_put_u64(serial_t *, uint64_t);
+void     serial_put_float(serial_t *, float);
+void     serial_put_double(serial_t *, double);
+void     serial_put_crc(serial_t *);
+
+bool     serial_get(serial_t *, void *, size_t);
+uint64_t serial_get_uint(serial_t *);
+int64_t  serial_get_int(serial_t *);
+uint32_t serial_get_u32(serial_t *);
+uint64_t serial_get_u64(serial_t *);
+float    serial_get_float(serial_t *);
+double   serial_get_double(serial_t *);
+bool     serial_get_crc(serial_t *);
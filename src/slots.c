@@ -0,0 +1,211 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include "slots.h"
+#include "journal.h"
+#include "serial.h"
+#include "device.h"
+
+/* The index is an 8-byte header followed by fixed-size entries, most
+ * recently saved first. Each entry carries its own CRC, so a damaged
+ * entry hides only itself, and entries are copied between index
+ * generations as raw bytes without being decoded. The index is only a
+ * cache of what the saves contain and is not synced to disk.
+ */
+
+#define INDEX_MAGIC   "GCOI"
+#define INDEX_VERSION 1
+#define INDEX_HEADER  8
+#define INDEX_ENTRY   128
+#define INDEX_PADDING (INDEX_ENTRY - 116) // after the fields, before the CRC
+
+bool
+slot_name_valid(const char *name)
+{
+    size_t len = strlen(name);
+    if (len == 0 || len >= SLOT_NAME_MAX)
+        return false;
+    for (size_t i = 0; i < len; i++)
+        if (!isalnum((unsigned char)name[i]) && name[i] != '-' &&
+            name[i] != '_')
+            return false;
+    return true;
+}
+
+/* Both buffers must hold SLOT_PATH_MAX bytes. */
+void
+slot_paths(const char *name, char *snapshot, char *journal)
+{
+    snprintf(snapshot, SLOT_PATH_MAX, "%s.gcom", name);
+    snprintf(journal, SLOT_PATH_MAX, "%s.journal", name);
+}
+
+void
+slot_describe(slot_t *slot, const char *name, game_t *game)
+{
+    memset(slot, 0, sizeof(*slot));
+    strncpy(slot->name, name, sizeof(slot->name) - 1);
+    game_date(game, slot->date);
+    slot->map_seed = game->map_seed;
+    slot->time = game->time;
+    slot->saved = device_uepoch() / 1000000;
+    slot->population = game->population;
+    slot->gold = game->gold;
+    slot->food = game->food;
+    slot->wood = game->wood;
+}
+
+/* Remove a slot's files and its index entry. */
+void
+slot_delete(const char *index, const char *name)
+{
+    char snapshot[SLOT_PATH_MAX];
+    char path[SLOT_PATH_MAX];
+    slot_paths(name, snapshot, path);
+    journal_t journal = {.snapshot = snapshot, .path = path};
+    journal_remove(&journal);
+    slot_index_remove(index, name);
+}
+
+/* Index */
+
+void
+slot_index_open(slot_index_t *index, const char *path)
+{
+    index->count = 0;
+    index->map = device_map(path, &index->size);
+    if (index->map) {
+        const char *header = index->map;
+        size_t entries = index->size - INDEX_HEADER;
+        if (index->size < INDEX_HEADER ||
+            memcmp(header, INDEX_MAGIC, 4) != 0 ||
+            header[4] != INDEX_VERSION ||
+            entries % INDEX_ENTRY != 0) {
+            slot_index_close(index);
+            return;
+        }
+        index->count = entries / INDEX_ENTRY;
+    }
+}
+
+void
+slot_index_close(slot_index_t *index)
+{
+    device_unmap(index->map, index->size);
+    index->map = NULL;
+    index->count = 0;
+}
+
+static const uint8_t *
+entry_bytes(slot_index_t *index, int i)
+{
+    return (const uint8_t *)index->map + INDEX_HEADER + i * INDEX_ENTRY;
+}
+
+/* Decode entry I. Returns false if it is damaged. */
+bool
+slot_index_get(slot_index_t *index, int i, slot_t *slot)
+{
+    if (i < 0 || i >= index->count)
+        return false;
+    serial_t s;
+    serial_init_buffer(&s, entry_bytes(index, i), INDEX_ENTRY);
+    uint8_t reserved[INDEX_PADDING];
+    serial_get(&s, slot->name, sizeof(slot->name));
+    serial_get(&s, slot->date, sizeof(slot->date));
+    slot->map_seed = serial_get_u64(&s);
+    slot->time = (int64_t)serial_get_u64(&s);
+    slot->saved = serial_get_u64(&s);
+    slot->population = serial_get_double(&s);
+    slot->gold = serial_get_double(&s);
+    slot->food = serial_get_double(&s);
+    slot->wood = serial_get_double(&s);
+    serial_get(&s, reserved, sizeof(reserved));
+    slot->name[sizeof(slot->name) - 1] = 0;
+    slot->date[sizeof(slot->date) - 1] = 0;
+    return serial_get_crc(&s) && slot_name_valid(slot->name);
+}
+
+/* Compare an entry's name without decoding the rest of it. */
+static bool
+entry_named(slot_index_t *index, int i, const char *name)
+{
+    const char *stored = (const char *)entry_bytes(index, i);
+    return strncmp(stored, name, SLOT_NAME_MAX) == 0;
+}
+
+int
+slot_index_find(slot_index_t *index, const char *name)
+{
+    for (int i = 0; i < index->count; i++)
+        if (entry_named(index, i, name))
+            return i;
+    return -1;
+}
+
+static void
+entry_write(serial_t *s, FILE *out, const slot_t *slot)
+{
+    uint8_t reserved[INDEX_PADDING] = {0};
+    serial_init(s, out);
+    serial_put(s, slot->name, sizeof(slot->name));
+    serial_put(s, slot->date, sizeof(slot->date));
+    serial_put_u64(s, slot->map_seed);
+    serial_put_u64(s, (int64_t)slot->time);
+    serial_put_u64(s, slot->saved);
+    serial_put_double(s, slot->population);
+    serial_put_double(s, slot->gold);
+    serial_put_double(s, slot->food);
+    serial_put_double(s, slot->wood);
+    serial_put(s, reserved, sizeof(reserved));
+    serial_put_crc(s);
+}
+
+/* Write a new generation of the index: SLOT (if any) first, then every
+ * old entry except the one named NAME. */
+static bool
+index_rewrite(const char *path, const char *name, const slot_t *slot)
+{
+    slot_index_t index;
+    slot_index_open(&index, path);
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *out = fopen(tmp, "wb");
+    if (!out) {
+        slot_index_close(&index);
+        return false;
+    }
+    uint8_t header[INDEX_HEADER] = {0};
+    memcpy(header, INDEX_MAGIC, 4);
+    header[4] = INDEX_VERSION;
+    serial_t s;
+    serial_init(&s, out);
+    serial_put(&s, header, sizeof(header));
+    bool success = serial_ok(&s);
+    if (slot) {
+        entry_write(&s, out, slot);
+        success &= serial_ok(&s);
+    }
+    for (int i = 0; i < index.count; i++)
+        if (!entry_named(&index, i, name))
+            success &= fwrite(entry_bytes(&index, i), INDEX_ENTRY, 1, out);
+    slot_index_close(&index);
+    success &= fclose(out) == 0;
+    if (success && device_replace(tmp, path))
+        return true;
+    unlink(tmp);
+    return false;
+}
+
+bool
+slot_index_update(const char *path, const slot_t *slot)
+{
+    return index_rewrite(path, slot->name, slot);
+}
+
+bool
+slot_index_remove(const char *path, const char *name)
+{
+    return index_rewrite(path, name, NULL);
+}
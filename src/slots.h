@@ -0,0 +1,42 @@
+/**
+ * Named save slots. Slot NAME lives in NAME.gcom with its journal in
+ * NAME.journal. A small index file holds a fixed-size metadata entry
+ * per slot so the slot picker can list any number of saves from one
+ * memory-mapped file without opening a single save.
+ */
+#pragma once
+
+#include "game.h"
+
+#define SLOT_INDEX    "saves.index"
+#define SLOT_DEFAULT  "persist"
+#define SLOT_NAME_MAX 24
+#define SLOT_PATH_MAX (SLOT_NAME_MAX + 16)
+
+typedef struct slot {
+    char name[SLOT_NAME_MAX];
+    char date[32];       // from game_date()
+    uint64_t map_seed;
+    long time;           // game time
+    uint64_t saved;      // wall clock seconds since the epoch
+    double population, gold, food, wood;
+} slot_t;
+
+/* A read-only view of the index file. */
+typedef struct slot_index {
+    const void *map;
+    size_t size;
+    int count;
+} slot_index_t;
+
+bool slot_name_valid(const char *name);
+void slot_paths(const char *name, char *snapshot, char *journal);
+void slot_describe(slot_t *, const char *name, game_t *);
+void slot_delete(const char *index, const char *name);
+
+void slot_index_open(slot_index_t *, const char *path);
+void slot_index_close(slot_index_t *);
+bool slot_index_get(slot_index_t *, int i, slot_t *);
+int  slot_index_find(slot_index_t *, const char *name);
+bool slot_index_update(const char *path, const slot_t *);
+bool slot_index_remove(const char *path, const char *name);
@@ -0,0 +1,301 @@
+/**
+ * Soak test. The autoplayer plays at unlimited speed for days of game
+ * time while per-phase timings and memory use are recorded for every
+ * game day, so performance regressions and leaks in long sessions
+ * show up without anyone playing. Every frame is rendered onto a
+ * virtual terminal, which must end up showing what the display meant
+ * to draw.
+ */
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "game.h"
+#include "device.h"
+#include "policy.h"
+#include "rand.h"
+#include "vterm.h"
+
+typedef struct phases {
+    uint64_t policy, sim, render, save;
+} phases_t;
+
+static long
+memory_resident(void)
+{
+    long size, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%ld %ld", &size, &resident) != 2)
+            resident = 0;
+        fclose(statm);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static long
+memory_peak(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static char *
+slurp(FILE *in, long *length)
+{
+    fseek(in, 0, SEEK_END);
+    *length = ftell(in);
+    rewind(in);
+    char *buffer = malloc(*length + 1);
+    if (buffer && fread(buffer, *length, 1, in) != 1 && *length) {
+        free(buffer);
+        buffer = NULL;
+    }
+    return buffer;
+}
+
+/* Save, load and save again: both saves must be identical, and the
+ * loaded game must hash the same as the original. */
+static bool
+save_roundtrip(game_t *game)
+{
+    FILE *a = tmpfile();
+    FILE *b = tmpfile();
+    bool success = false;
+    if (a && b && game_save(game, a)) {
+        rewind(a);
+        game_t *copy = game_load(a);
+        if (copy && game_save(copy, b)) {
+            long alen, blen;
+            char *abuf = slurp(a, &alen);
+            char *bbuf = slurp(b, &blen);
+            success = abuf && bbuf && alen == blen &&
+                      memcmp(abuf, bbuf, alen) == 0 &&
+                      game_hash(copy) == game_hash(game);
+            free(abuf);
+            free(bbuf);
+        }
+        if (copy)
+            game_free(copy);
+    }
+    if (a)
+        fclose(a);
+    if (b)
+        fclose(b);
+    return success;
+}
+
+static void
+render(game_t *game, terrain_t *terrain, panel_t *buildings, panel_t *units)
+{
+    map_draw_terrain(terrain, &game->map, game->map_seed);
+    panel_clear(buildings);
+    map_draw_buildings(&game->map, game->time, buildings);
+    panel_clear(units);
+    game_draw_units(game, units, false);
+}
+
+static int
+count_active(game_t *game)
+{
+    int count = 0;
+    for (unsigned i = 0; i < countof(game->heroes); i++)
+        count += game->heroes[i].active;
+    return count;
+}
+
+static void
+usage(FILE *out)
+{
+    fprintf(out,
+            "usage: soak [-d days] [-s seed] [-p policy] [-o csv]\n"
+            "policies:");
+    for (const policy_t *p = policies; p->name; p++)
+        fprintf(out, " %s", p->name);
+    fprintf(out, "\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    int days = 100;
+    uint64_t seed = 0;
+    const policy_t *policy = policy_find("auto");
+    const char *output = "soak.csv";
+    int option;
+    while ((option = getopt(argc, argv, "d:s:p:o:h")) != -1) {
+        switch (option) {
+        case 'd':
+            days = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'p':
+            if (!(policy = policy_find(optarg))) {
+                fprintf(stderr, "soak: unknown policy %s\n", optarg);
+                usage(stderr);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'h':
+            usage(stdout);
+            exit(EXIT_SUCCESS);
+        default:
+            usage(stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+    FILE *csv = fopen(output, "w");
+    if (!csv) {
+        fprintf(stderr, "soak: could not write %s\n", output);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(csv, "day,game,step_ns,policy_us,sim_us,render_us,save_us,"
+            "rss_kb,peak_kb,population,gold,food,wood,invaders,heroes,hash\n");
+
+    vterm_t *vt = malloc(sizeof(*vt));
+    panel_t *panels = malloc(sizeof(*panels) * 3);
+    terrain_t *terrain = malloc(sizeof(*terrain));
+    if (!vt || !panels || !terrain) {
+        fprintf(stderr, "soak: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    vterm_init(vt);
+    device_t *device = device_init_virtual(vt);
+    if (!device) {
+        fprintf(stderr, "soak: could not create a virtual terminal\n");
+        exit(EXIT_FAILURE);
+    }
+    display_t display;
+    display_init(&display, device);
+    for (int i = 0; i < 3; i++) {
+        if (!panel_init(panels + i, &display, 0, 0, MAP_WIDTH, MAP_HEIGHT)) {
+            fprintf(stderr, "soak: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        display_push(&display, panels + i);
+    }
+    map_terrain_init(terrain, panels + 0);
+
+    uint64_t state = seed * UINT64_C(0x9e3779b97f4a7c15) | 1;
+    uint64_t map_seed = xorshift(&state);
+    game_t *game = game_create(map_seed, xorshift(&state));
+    int games = 1, wins = 0, losses = 0, bad_saves = 0, bad_hashes = 0;
+    int bad_frames = 0;
+    bool won = false; // the current game
+    long rss_first = 0, rss_last = 0;
+    uint64_t sim_total = 0, steps_total = 0, worst_day = 0;
+
+    for (int day = 1; day <= days; day++) {
+        phases_t t = {0, 0, 0, 0};
+        long steps = 0;
+        for (int hour = 0; hour < DAY / HOUR; hour++) {
+            uint64_t start = device_uepoch();
+            policy->step(game);
+            uint64_t mark = device_uepoch();
+            t.policy += mark - start;
+
+            bool lost = false;
+            for (int i = 0; !lost && i < HOUR; i++) {
+                game_step(game);
+                enum game_event event;
+                while ((event = game_event_pop(game)) != EVENT_NONE) {
+                    if (event == EVENT_LOSE) {
+                        lost = true;
+                    } else if (event == EVENT_WIN && !won) {
+                        won = true;
+                        wins++;
+                    }
+                }
+                steps++;
+            }
+            start = device_uepoch();
+            t.sim += start - mark;
+
+            render(game, terrain, panels + 1, panels + 2);
+            display_refresh(&display);
+            if (!vterm_matches(vt, &display) && bad_frames++ == 0)
+                fprintf(stderr, "soak: day %d: screen does not match\n", day);
+            mark = device_uepoch();
+            t.render += mark - start;
+
+            if (lost) {
+                /* Keep soaking on a fresh map. */
+                losses++;
+                games++;
+                won = false;
+                game_free(game);
+                map_seed = xorshift(&state);
+                game = game_create(map_seed, xorshift(&state));
+            }
+        }
+        uint64_t start = device_uepoch();
+        if (!save_roundtrip(game)) {
+            fprintf(stderr, "soak: day %d: save round trip mismatch\n", day);
+            bad_saves++;
+        }
+        t.save = device_uepoch() - start;
+        uint64_t hash = game_hash(game);
+        if (hash != game_hash_full(game)) {
+            fprintf(stderr, "soak: day %d: incremental hash drifted\n", day);
+            bad_hashes++;
+        }
+
+        long rss = memory_resident();
+        if (day == 1)
+            rss_first = rss;
+        rss_last = rss;
+        sim_total += t.sim;
+        steps_total += steps;
+        if (t.sim > worst_day)
+            worst_day = t.sim;
+        int invaders = 0;
+        for (unsigned i = 0; i < countof(game->invaders); i++)
+            invaders += game->invaders[i].active;
+        fprintf(csv, "%d,%d,%.1f,%llu,%llu,%llu,%llu,%ld,%ld,"
+                "%.0f,%.1f,%.1f,%.1f,%d,%d,%016llx\n",
+                day, games, t.sim * 1000.0 / steps,
+                (unsigned long long)t.policy, (unsigned long long)t.sim,
+                (unsigned long long)t.render, (unsigned long long)t.save,
+                rss, memory_peak(), game->population,
+                game->gold, game->food, game->wood,
+                invaders, count_active(game), (unsigned long long)hash);
+        fflush(csv);
+    }
+
+    printf("days:        %d\n", days);
+    printf("games:       %d (%d won, %d lost)\n", games, wins, losses);
+    printf("step:        %.1f ns mean, worst day %.1f ms\n",
+           sim_total * 1000.0 / steps_total, worst_day / 1000.0);
+    printf("resident:    %ld kB first day, %ld kB last day\n",
+           rss_first, rss_last);
+    printf("peak:        %ld kB\n", memory_peak());
+    printf("bad saves:   %d\n", bad_saves);
+    printf("bad hashes:  %d\n", bad_hashes);
+    vterm_stats_t *vs = &vt->stats;
+    double frames = vs->frames ? vs->frames : 1;
+    printf("terminal:    %.0f bytes, %.1f moves, %.1f colors per frame\n",
+           vs->bytes / frames, vs->moves / frames, vs->colors / frames);
+    printf("bad frames:  %d\n", bad_frames);
+
+    for (int i = 2; i >= 0; i--) {
+        display_pop(&display);
+        panel_free(panels + i);
+    }
+    display_free(&display);
+    device_free(device);
+    free(vt);
+    game_free(game);
+    free(terrain);
+    free(panels);
+    fclose(csv);
+    /* Winning or losing is up to the policy, not a soak failure. */
+    return bad_saves || bad_hashes || bad_frames ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,310 @@
+/**
+ * Headless balance sweep. Plays many independent games with a
+ * scripted policy across all cores and aggregates win/lose rates,
+ * time-to-win and daily resource curves into CSV and JSON.
+ */
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "game.h"
+#include "device.h"
+#include "policy.h"
+#include "rand.h"
+
+#define JOBS_MAX 256
+
+enum outcome { OUTCOME_TIMEOUT, OUTCOME_WIN, OUTCOME_LOSE };
+
+static const char *outcome_names[] = {"timeout", "win", "lose"};
+
+typedef struct sample {
+    float gold, food, wood, population;
+} sample_t;
+
+typedef struct result {
+    uint64_t map_seed;
+    uint64_t rand_seed;
+    enum outcome outcome;
+    long time;
+    double gold, food, wood, population;
+} result_t;
+
+typedef struct sweep {
+    long games;
+    int jobs;
+    int days;
+    uint64_t seed;
+    float spawn_rate;
+    const policy_t *policy;
+    const char *prefix;
+    long next;
+    result_t *results;
+    sample_t *curves;
+} sweep_t;
+
+static void
+sweep_play(sweep_t *s, long index)
+{
+    result_t *r = s->results + index;
+    sample_t *curve = s->curves + index * s->days;
+    uint64_t state = (s->seed + index) * UINT64_C(0x9e3779b97f4a7c15) | 1;
+    r->rand_seed = xorshift(&state);
+    r->map_seed = xorshift(&state);
+
+    game_t *game = game_create(r->map_seed, r->rand_seed);
+    game->spawn_rate = s->spawn_rate;
+    long end = s->days * (long)DAY;
+    r->outcome = OUTCOME_TIMEOUT;
+    while (game->time < end && r->outcome == OUTCOME_TIMEOUT) {
+        if (game->time % (long)POLICY_PERIOD == 0)
+            s->policy->step(game);
+        game_step(game);
+        enum game_event event;
+        while ((event = game_event_pop(game)) != EVENT_NONE) {
+            if (event == EVENT_WIN)
+                r->outcome = OUTCOME_WIN;
+            else if (event == EVENT_LOSE)
+                r->outcome = OUTCOME_LOSE;
+        }
+        if (game->time % (long)DAY == 0) {
+            sample_t *d = curve + game->time / (long)DAY - 1;
+            d->gold = game->gold;
+            d->food = game->food;
+            d->wood = game->wood;
+            d->population = game->population;
+        }
+    }
+    r->time = game->time;
+    r->gold = game->gold;
+    r->food = game->food;
+    r->wood = game->wood;
+    r->population = game->population;
+    game_free(game);
+}
+
+static void *
+sweep_worker(void *arg)
+{
+    sweep_t *s = arg;
+    for (;;) {
+        long i = __sync_fetch_and_add(&s->next, 1);
+        if (i >= s->games)
+            break;
+        sweep_play(s, i);
+    }
+    return NULL;
+}
+
+static bool
+sweep_run(sweep_t *s)
+{
+    s->next = 0;
+    s->results = calloc(s->games, sizeof(*s->results));
+    s->curves = calloc(s->games * s->days, sizeof(*s->curves));
+    if (!s->results || !s->curves)
+        return false;
+    pthread_t threads[JOBS_MAX];
+    int started = 0;
+    for (int i = 0; i < s->jobs; i++)
+        if (pthread_create(threads + started, NULL, sweep_worker, s) == 0)
+            started++;
+    if (started == 0)
+        sweep_worker(s);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    return true;
+}
+
+static int
+compare_long(const void *a, const void *b)
+{
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static FILE *
+output_open(const char *prefix, const char *suffix)
+{
+    char path[1024];
+    snprintf(path, sizeof(path), "%s%s", prefix, suffix);
+    FILE *out = fopen(path, "w");
+    if (!out)
+        fprintf(stderr, "sweep: could not write %s\n", path);
+    return out;
+}
+
+static bool
+sweep_report(sweep_t *s)
+{
+    FILE *games = output_open(s->prefix, ".csv");
+    FILE *curves = output_open(s->prefix, "-curves.csv");
+    FILE *summary = output_open(s->prefix, ".json");
+    long *win_days = malloc(sizeof(*win_days) * (s->games + 1));
+    bool success = false;
+    if (!win_days)
+        fprintf(stderr, "sweep: out of memory\n");
+    if (!games || !curves || !summary || !win_days)
+        goto done;
+
+    long count[3] = {0, 0, 0};
+    fprintf(games, "game,map_seed,rand_seed,outcome,days,"
+            "gold,food,wood,population\n");
+    for (long i = 0; i < s->games; i++) {
+        result_t *r = s->results + i;
+        count[r->outcome]++;
+        if (r->outcome == OUTCOME_WIN)
+            win_days[count[OUTCOME_WIN] - 1] = r->time;
+        fprintf(games, "%ld,%llu,%llu,%s,%.3f,%.1f,%.1f,%.1f,%.0f\n",
+                i,
+                (unsigned long long)r->map_seed,
+                (unsigned long long)r->rand_seed,
+                outcome_names[r->outcome], r->time / DAY,
+                r->gold, r->food, r->wood, r->population);
+    }
+
+    fprintf(curves, "day,games,gold,food,wood,population\n");
+    for (int d = 0; d < s->days; d++) {
+        long n = 0;
+        double sum[4] = {0, 0, 0, 0};
+        for (long i = 0; i < s->games; i++) {
+            if (s->results[i].time / (long)DAY > d) {
+                sample_t *v = s->curves + i * s->days + d;
+                sum[0] += v->gold;
+                sum[1] += v->food;
+                sum[2] += v->wood;
+                sum[3] += v->population;
+                n++;
+            }
+        }
+        if (n == 0)
+            break;
+        fprintf(curves, "%d,%ld,%.1f,%.1f,%.1f,%.1f\n", d + 1, n,
+                sum[0] / n, sum[1] / n, sum[2] / n, sum[3] / n);
+    }
+
+    long wins = count[OUTCOME_WIN];
+    qsort(win_days, wins, sizeof(*win_days), compare_long);
+    double mean = 0;
+    for (long i = 0; i < wins; i++)
+        mean += win_days[i] / DAY;
+    fprintf(summary,
+            "{\n"
+            "  \"policy\": \"%s\",\n"
+            "  \"games\": %ld,\n"
+            "  \"max_days\": %d,\n"
+            "  \"seed\": %llu,\n"
+            "  \"spawn_rate\": %g,\n"
+            "  \"win_population\": %d,\n"
+            "  \"wins\": %ld,\n"
+            "  \"losses\": %ld,\n"
+            "  \"timeouts\": %ld,\n"
+            "  \"win_rate\": %.4f,\n"
+            "  \"lose_rate\": %.4f,\n",
+            s->policy->name, s->games, s->days,
+            (unsigned long long)s->seed, s->spawn_rate, GAME_WIN_POP,
+            wins, count[OUTCOME_LOSE], count[OUTCOME_TIMEOUT],
+            wins / (double)s->games,
+            count[OUTCOME_LOSE] / (double)s->games);
+    if (wins > 0)
+        fprintf(summary,
+                "  \"days_to_win\": "
+                "{\"mean\": %.3f, \"min\": %.3f, "
+                "\"median\": %.3f, \"max\": %.3f}\n",
+                mean / wins, win_days[0] / DAY,
+                win_days[wins / 2] / DAY, win_days[wins - 1] / DAY);
+    else
+        fprintf(summary, "  \"days_to_win\": null\n");
+    fprintf(summary, "}\n");
+    success = !ferror(games) && !ferror(curves) && !ferror(summary);
+
+done:
+    free(win_days);
+    if (games && fclose(games) != 0)
+        success = false;
+    if (curves && fclose(curves) != 0)
+        success = false;
+    if (summary && fclose(summary) != 0)
+        success = false;
+    return success;
+}
+
+static void
+usage(FILE *out)
+{
+    fprintf(out,
+            "usage: sweep [-n games] [-j jobs] [-d days] [-s seed] "
+            "[-r spawn/day] [-p policy] [-o prefix]\n"
+            "policies:");
+    for (const policy_t *p = policies; p->name; p++)
+        fprintf(out, " %s", p->name);
+    fprintf(out, "\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    sweep_t sweep = {
+        .games = 1000,
+        .jobs = device_cpu_count(),
+        .days = 30,
+        .seed = 0,
+        .spawn_rate = INVADER_SPAWN_RATE,
+        .policy = policy_find("greedy"),
+        .prefix = "sweep"
+    };
+    int option;
+    while ((option = getopt(argc, argv, "n:j:d:s:r:p:o:h")) != -1) {
+        switch (option) {
+        case 'n':
+            sweep.games = strtol(optarg, NULL, 10);
+            break;
+        case 'j':
+            sweep.jobs = atoi(optarg);
+            break;
+        case 'd':
+            sweep.days = atoi(optarg);
+            break;
+        case 's':
+            sweep.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'r':
+            sweep.spawn_rate = strtof(optarg, NULL);
+            break;
+        case 'p':
+            if (!(sweep.policy = policy_find(optarg))) {
+                fprintf(stderr, "sweep: unknown policy %s\n", optarg);
+                usage(stderr);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'o':
+            sweep.prefix = optarg;
+            break;
+        case 'h':
+            usage(stdout);
+            exit(EXIT_SUCCESS);
+        default:
+            usage(stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (sweep.games < 1 || sweep.jobs < 1 || sweep.days < 1) {
+        usage(stderr);
+        exit(EXIT_FAILURE);
+    }
+    if (sweep.jobs > sweep.games)
+        sweep.jobs = sweep.games; // the rest would have nothing to do
+    if (sweep.jobs > JOBS_MAX)
+        sweep.jobs = JOBS_MAX;
+    if (!sweep_run(&sweep)) {
+        fprintf(stderr, "sweep: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!sweep_report(&sweep))
+        exit(EXIT_FAILURE);
+    return 0;
+}
@@ -0,0 +1,240 @@
+#include <stdlib.h>
+#include <string.h>
+#include "timeline.h"
+
+/* Deltas are runs of (bytes unchanged, bytes changed, the changed
+ * bytes XORed with the reference), the counts as varints. Most of a
+ * game_t is terrain and empty slots that never change, so a keyframe
+ * usually codes to a few hundred bytes. */
+
+#define SCRATCH_SIZE (sizeof(game_t) * 2 + 16) // worst case delta
+
+static size_t
+put_count(uint8_t *out, size_t v)
+{
+    size_t len = 0;
+    do {
+        out[len] = v & 0x7f;
+        v >>= 7;
+        if (v)
+            out[len] |= 0x80;
+        len++;
+    } while (v);
+    return len;
+}
+
+static size_t
+get_count(const uint8_t *in, size_t *v)
+{
+    size_t len = 0;
+    *v = 0;
+    do
+        *v |= (size_t)(in[len] & 0x7f) << (7 * len);
+    while (in[len++] & 0x80);
+    return len;
+}
+
+static size_t
+delta_encode(uint8_t *out, const void *game, const void *reference)
+{
+    const uint8_t *a = game;
+    const uint8_t *b = reference;
+    size_t n = sizeof(game_t);
+    size_t len = 0;
+    for (size_t i = 0; i < n;) {
+        size_t same = i;
+        while (same < n && a[same] == b[same])
+            same++;
+        size_t diff = same;
+        while (diff < n && a[diff] != b[diff])
+            diff++;
+        len += put_count(out + len, same - i);
+        len += put_count(out + len, diff - same);
+        for (size_t j = same; j < diff; j++)
+            out[len++] = a[j] ^ b[j];
+        i = diff;
+    }
+    return len;
+}
+
+static void
+delta_apply(void *game, const uint8_t *delta, size_t size)
+{
+    uint8_t *p = game;
+    for (size_t i = 0; i < size;) {
+        size_t same, diff;
+        i += get_count(delta + i, &same);
+        i += get_count(delta + i, &diff);
+        p += same;
+        for (size_t j = 0; j < diff; j++)
+            *p++ ^= delta[i++];
+    }
+}
+
+/* Rebuild keyframe I into OUT. */
+static void
+frame_decode(timeline_t *tl, int i, game_t *out)
+{
+    int first = i;
+    while (!tl->frames[first].full)
+        first--;
+    game_copy(out, tl->origin);
+    for (int j = first; j <= i; j++)
+        delta_apply(out, tl->frames[j].delta, tl->frames[j].size);
+}
+
+static void
+frames_drop(timeline_t *tl, int first, int end)
+{
+    for (int i = first; i < end; i++) {
+        tl->bytes -= tl->frames[i].size + sizeof(tl->frames[i]);
+        free(tl->frames[i].delta);
+    }
+    memmove(tl->frames + first, tl->frames + end,
+            sizeof(*tl->frames) * (tl->count - end));
+    tl->count -= end - first;
+}
+
+/* Drop the oldest chains until the history fits its budget. The newest
+ * chain always stays. */
+static void
+timeline_trim(timeline_t *tl)
+{
+    while (tl->bytes > tl->budget) {
+        int next = 1;
+        while (next < tl->count && !tl->frames[next].full)
+            next++;
+        if (next >= tl->count)
+            break;
+        frames_drop(tl, 0, next);
+    }
+}
+
+bool
+timeline_init(timeline_t *tl, game_t *game, size_t budget)
+{
+    memset(tl, 0, sizeof(*tl));
+    tl->budget = budget;
+    tl->origin = game_clone(game);
+    tl->last = game_clone(game);
+    tl->scratch = malloc(SCRATCH_SIZE);
+    if (!tl->origin || !tl->last || !tl->scratch) {
+        timeline_free(tl);
+        return false;
+    }
+    tl->bytes = sizeof(game_t) * 2 + SCRATCH_SIZE;
+    timeline_mark(tl, game);
+    return true;
+}
+
+void
+timeline_free(timeline_t *tl)
+{
+    for (int i = 0; i < tl->count; i++)
+        free(tl->frames[i].delta);
+    free(tl->frames);
+    free(tl->scratch);
+    game_free(tl->last);
+    game_free(tl->origin);
+    memset(tl, 0, sizeof(*tl));
+}
+
+/* Take a keyframe of GAME now. Must be called after every player
+ * command, since the history does not record commands themselves. */
+void
+timeline_mark(timeline_t *tl, game_t *game)
+{
+    if (!tl->origin)
+        return;
+    if (tl->count == tl->capacity) {
+        int capacity = tl->capacity ? tl->capacity * 2 : 64;
+        keyframe_t *frames = realloc(tl->frames, sizeof(*frames) * capacity);
+        if (!frames)
+            goto fail;
+        tl->frames = frames;
+        tl->capacity = capacity;
+    }
+    bool full = tl->count == 0 || tl->since_full >= TIMELINE_FULL_EVERY;
+    game_t *reference = full ? tl->origin : tl->last;
+    size_t size = delta_encode(tl->scratch, game, reference);
+    uint8_t *delta = malloc(size);
+    if (!delta)
+        goto fail;
+    memcpy(delta, tl->scratch, size);
+    tl->frames[tl->count++] = (keyframe_t){game->time, full, size, delta};
+    tl->since_full = full ? 1 : tl->since_full + 1;
+    tl->bytes += size + sizeof(keyframe_t);
+    game_copy(tl->last, game);
+    timeline_trim(tl);
+    return;
+
+fail:
+    /* A missing keyframe would let a seek step over a command, so
+     * forget everything before this point instead. */
+    frames_drop(tl, 0, tl->count);
+    tl->since_full = 0;
+}
+
+/* Called once per frame: take a keyframe when one is due. */
+void
+timeline_update(timeline_t *tl, game_t *game)
+{
+    if (tl->count == 0 ||
+        game->time - tl->frames[tl->count - 1].time >= TIMELINE_INTERVAL)
+        timeline_mark(tl, game);
+}
+
+/* The earliest game time that can still be reached, or -1. */
+long
+timeline_start(timeline_t *tl)
+{
+    return tl->count ? tl->frames[0].time : -1;
+}
+
+/* Index of the last keyframe at or before TIME. */
+static int
+frame_find(timeline_t *tl, long time)
+{
+    int lo = 0;
+    int hi = tl->count;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (tl->frames[mid].time <= time)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Rebuild the game as it was at TIME into OUT. TIME must not be later
+ * than the game the history was last updated from. */
+bool
+timeline_seek(timeline_t *tl, long time, game_t *out)
+{
+    if (tl->count == 0 || time < tl->frames[0].time)
+        return false;
+    frame_decode(tl, frame_find(tl, time), out);
+    while (out->time < time) {
+        game_step(out);
+        while (game_event_pop(out) != EVENT_NONE);
+    }
+    return true;
+}
+
+/* Continue the history from GAME, a state returned by timeline_seek(),
+ * forgetting everything after it. */
+void
+timeline_branch(timeline_t *tl, game_t *game)
+{
+    if (tl->count == 0)
+        return;
+    int i = frame_find(tl, game->time);
+    frames_drop(tl, i + 1, tl->count);
+    tl->since_full = 0;
+    for (int j = i; !tl->frames[j].full; j--)
+        tl->since_full++;
+    tl->since_full++;
+    frame_decode(tl, i, tl->last);
+    timeline_mark(tl, game);
+}
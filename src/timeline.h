@@ -0,0 +1,44 @@
+/**
+ * Rewindable game history. Keyframes of the whole game_t are taken
+ * every TIMELINE_INTERVAL of game time and after every player command,
+ * each stored as a run-length coded XOR against the previous keyframe,
+ * with every TIMELINE_FULL_EVERY-th coded against the first game
+ * instead so that no chain gets long. Any moment in between is rebuilt
+ * by stepping the deterministic simulation forward from the keyframe
+ * before it. Once the history outgrows its budget, the oldest keyframes
+ * are dropped.
+ */
+#pragma once
+
+#include "game.h"
+
+#define TIMELINE_INTERVAL   HOUR      // game time between keyframes
+#define TIMELINE_FULL_EVERY 16        // keyframes per delta chain
+#define TIMELINE_BUDGET     (4 << 20) // default bytes of history
+
+typedef struct keyframe {
+    long time;
+    bool full;      // coded against the origin, not the previous keyframe
+    size_t size;
+    uint8_t *delta;
+} keyframe_t;
+
+typedef struct timeline {
+    game_t *origin; // the game the history starts from
+    game_t *last;   // the newest keyframe, decoded
+    uint8_t *scratch;
+    keyframe_t *frames;
+    int count;
+    int capacity;
+    int since_full;
+    size_t bytes;   // memory held, including the two games above
+    size_t budget;
+} timeline_t;
+
+bool timeline_init(timeline_t *, game_t *, size_t budget);
+void timeline_free(timeline_t *);
+void timeline_update(timeline_t *, game_t *);
+void timeline_mark(timeline_t *, game_t *);
+long timeline_start(timeline_t *);
+bool timeline_seek(timeline_t *, long time, game_t *out);
+void timeline_branch(timeline_t *, game_t *);
@@ -0,0 +1,260 @@
+#include <string.h>
+#include "vterm.h"
+#include "utf.h"
+
+/* Only what the devices emit is understood: UTF-8 glyphs, CR, LF, the
+ * CSI sequences CUP, CUU, CUD, CUF, CUB, SGR (16 colors) and ED, with
+ * everything else (private modes, the window title) skipped. The
+ * cursor wraps the way xterm's does: writing the last column parks it
+ * there until the next glyph. */
+
+#define VTERM_FONT ((font_t){COLOR_WHITE, COLOR_BLACK, false, false})
+
+void
+vterm_init(vterm_t *vt)
+{
+    memset(vt, 0, sizeof(*vt));
+    vt->font = VTERM_FONT;
+    for (int y = 0; y < DISPLAY_HEIGHT; y++) {
+        for (int x = 0; x < DISPLAY_WIDTH; x++) {
+            vt->screen[x][y].c = ' ';
+            vt->screen[x][y].font = VTERM_FONT;
+        }
+    }
+}
+
+static void
+line_feed(vterm_t *vt)
+{
+    if (vt->y < DISPLAY_HEIGHT - 1) {
+        vt->y++;
+        return;
+    }
+    for (int x = 0; x < DISPLAY_WIDTH; x++) {
+        memmove(&vt->screen[x][0], &vt->screen[x][1],
+                sizeof(vt->screen[x][0]) * (DISPLAY_HEIGHT - 1));
+        vt->screen[x][DISPLAY_HEIGHT - 1].c = ' ';
+        vt->screen[x][DISPLAY_HEIGHT - 1].font = vt->font;
+    }
+    vt->stats.scrolls++;
+}
+
+static int
+clamp(int v, int lo, int hi)
+{
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+static void
+sgr(vterm_t *vt, const int *params, int count)
+{
+    if (count == 0)
+        vt->font = VTERM_FONT;
+    for (int i = 0; i < count; i++) {
+        int v = params[i];
+        if (v == 0) {
+            vt->font = VTERM_FONT;
+        } else if (v >= 30 && v <= 37) {
+            vt->font.fore = v - 30;
+            vt->font.fore_bright = false;
+        } else if (v >= 90 && v <= 97) {
+            vt->font.fore = v - 90;
+            vt->font.fore_bright = true;
+        } else if (v >= 40 && v <= 47) {
+            vt->font.back = v - 40;
+            vt->font.back_bright = false;
+        } else if (v >= 100 && v <= 107) {
+            vt->font.back = v - 100;
+            vt->font.back_bright = true;
+        }
+    }
+}
+
+static void
+csi(vterm_t *vt, const uint8_t *p, size_t len)
+{
+    int params[8] = {0};
+    int count = 0;
+    bool private = false;
+    for (size_t i = 2; i < len - 1; i++) {
+        if (p[i] == '?') {
+            private = true;
+        } else if (p[i] == ';') {
+            if (count < 7)
+                count++;
+        } else if (p[i] >= '0' && p[i] <= '9') {
+            params[count] = params[count] * 10 + p[i] - '0';
+        }
+    }
+    if (len > 3)
+        count++;
+    int n = params[0] ? params[0] : 1;
+    if (private)
+        return;
+    switch (p[len - 1]) {
+    case 'H':
+        vt->y = clamp((params[0] ? params[0] : 1) - 1, 0, DISPLAY_HEIGHT - 1);
+        vt->x = clamp((params[1] ? params[1] : 1) - 1, 0, DISPLAY_WIDTH - 1);
+        break;
+    case 'A':
+        vt->y = clamp(vt->y - n, 0, DISPLAY_HEIGHT - 1);
+        break;
+    case 'B':
+        vt->y = clamp(vt->y + n, 0, DISPLAY_HEIGHT - 1);
+        break;
+    case 'C':
+        vt->x = clamp(vt->x + n, 0, DISPLAY_WIDTH - 1);
+        break;
+    case 'D':
+        vt->x = clamp(vt->x - n, 0, DISPLAY_WIDTH - 1);
+        break;
+    case 'm':
+        vt->stats.colors++;
+        sgr(vt, params, count);
+        return;
+    case 'J':
+        if (params[0] == 2) {
+            for (int y = 0; y < DISPLAY_HEIGHT; y++) {
+                for (int x = 0; x < DISPLAY_WIDTH; x++) {
+                    vt->screen[x][y].c = ' ';
+                    vt->screen[x][y].font = vt->font;
+                }
+            }
+        }
+        return;
+    default:
+        return;
+    }
+    vt->stats.moves++;
+    vt->wrap = false;
+}
+
+static void
+glyph(vterm_t *vt, uint16_t c)
+{
+    if (vt->wrap) {
+        vt->x = 0;
+        line_feed(vt);
+        vt->wrap = false;
+    }
+    vt->screen[vt->x][vt->y].c = c;
+    vt->screen[vt->x][vt->y].font = vt->font;
+    vt->stats.glyphs++;
+    if (vt->x == DISPLAY_WIDTH - 1)
+        vt->wrap = true;
+    else
+        vt->x++;
+}
+
+/* Interpret one complete token at P. Returns its length, or 0 if it is
+ * cut off by the end of the input. */
+static size_t
+token(vterm_t *vt, const uint8_t *p, size_t n)
+{
+    if (p[0] == '\e') {
+        if (n < 2)
+            return 0;
+        if (p[1] == '[') {
+            for (size_t i = 2; i < n; i++) {
+                if (p[i] >= 0x40 && p[i] <= 0x7e) {
+                    csi(vt, p, i + 1);
+                    return i + 1;
+                }
+            }
+            return 0;
+        } else if (p[1] == ']') {
+            for (size_t i = 2; i < n; i++)
+                if (p[i] == '\a')
+                    return i + 1;
+            return 0;
+        }
+        return 2;
+    } else if (p[0] == '\r') {
+        vt->x = 0;
+        vt->wrap = false;
+        vt->stats.moves++;
+        return 1;
+    } else if (p[0] == '\n') {
+        line_feed(vt);
+        vt->wrap = false;
+        vt->stats.moves++;
+        return 1;
+    } else if (p[0] < 0x20) {
+        return 1;
+    }
+    size_t len = utf8_charlen(p[0]);
+    if (len == 0)
+        return 1; // not a lead byte
+    if (n < len)
+        return 0;
+    glyph(vt, utf8_to_32(p));
+    return len;
+}
+
+void
+vterm_feed(vterm_t *vt, const void *data, size_t n)
+{
+    const uint8_t *p = data;
+    vt->stats.bytes += n;
+    /* Complete a token left over from the previous feed first. */
+    while (vt->partial_len && n) {
+        vt->partial[vt->partial_len++] = *p++;
+        n--;
+        size_t used = token(vt, vt->partial, vt->partial_len);
+        if (used || vt->partial_len == sizeof(vt->partial))
+            vt->partial_len = 0; // done, or garbage
+    }
+    while (n) {
+        size_t used = token(vt, p, n);
+        if (!used) {
+            if (n <= sizeof(vt->partial)) {
+                memcpy(vt->partial, p, n);
+                vt->partial_len = n;
+            }
+            return;
+        }
+        p += used;
+        n -= used;
+    }
+}
+
+void
+vterm_frame(vterm_t *vt)
+{
+    vt->stats.frames++;
+}
+
+/* Script the keyboard: KEYS are read byte by byte, escape sequences
+ * and all, after which the device reports ^C. */
+void
+vterm_keys(vterm_t *vt, const char *keys)
+{
+    vt->keys = keys;
+}
+
+/* The next scripted byte, or -1 once the script is used up. */
+int
+vterm_getc(vterm_t *vt)
+{
+    if (!vterm_pending(vt))
+        return -1;
+    return (uint8_t)*vt->keys++;
+}
+
+bool
+vterm_pending(vterm_t *vt)
+{
+    return vt->keys && *vt->keys;
+}
+
+/* True if the screen shows exactly what the display believes it does. */
+bool
+vterm_matches(vterm_t *vt, display_t *d)
+{
+    for (int y = 0; y < DISPLAY_HEIGHT; y++)
+        for (int x = 0; x < DISPLAY_WIDTH; x++)
+            if (cell_pack(vt->screen[x][y].font, vt->screen[x][y].c) !=
+                d->current[y][x])
+                return false;
+    return true;
+}
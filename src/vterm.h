@@ -0,0 +1,42 @@
+/**
+ * Virtual terminal. Interprets the byte stream a device would send to
+ * a real terminal (UTF-8 text, cursor motion, colors) onto an in-memory
+ * screen, counting what it was sent, and supplies scripted keys in
+ * place of a keyboard. With device_init_virtual() the renderer and the
+ * UI run without a terminal, so their output can be measured exactly
+ * and the resulting screen checked.
+ */
+#pragma once
+
+#include "display.h"
+
+typedef struct vterm_stats {
+    uint64_t bytes;
+    uint64_t frames;  // flushes
+    uint64_t moves;   // cursor motions: CUP, CUU/CUD/CUF/CUB, CR and LF
+    uint64_t colors;  // SGR sequences
+    uint64_t glyphs;
+    uint64_t scrolls; // lines scrolled off the top, always a bug
+} vterm_stats_t;
+
+typedef struct vterm {
+    struct {
+        uint16_t c;
+        font_t font;
+    } screen[DISPLAY_WIDTH][DISPLAY_HEIGHT];
+    int x, y;
+    bool wrap;     // the last column was written, next glyph wraps
+    font_t font;
+    uint8_t partial[64]; // a sequence split across feeds
+    size_t partial_len;
+    const char *keys;    // scripted input, not copied
+    vterm_stats_t stats;
+} vterm_t;
+
+void vterm_init(vterm_t *);
+void vterm_feed(vterm_t *, const void *, size_t);
+void vterm_frame(vterm_t *);
+void vterm_keys(vterm_t *, const char *);
+int  vterm_getc(vterm_t *);
+bool vterm_pending(vterm_t *);
+bool vterm_matches(vterm_t *, display_t *);